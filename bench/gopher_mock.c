@@ -0,0 +1,230 @@
+// Mock gopher server to load test idigna against: made-up text files, binary files and gophermaps of any size, served after a set latency
+// Selectors are text/<bytes>, binary/<bytes> and map/<entries>, with anything after a further / ignored so requests can be told apart
+// Run by bench/load.sh as part of `make bench`
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Bodies are cut from text, data and gophermap made up front, so serving them costs next to nothing next to idigna
+#define TEXT_SIZE (16 * 1024 * 1024)
+#define BINARY_SIZE (16 * 1024 * 1024)
+#define MAP_ENTRIES 100000
+#define SELECTOR_MAX 1024
+
+long int port = 7070;
+long int latency = 0; // In milliseconds
+
+char *text;
+size_t text_size;
+char *binary;
+char *map;
+size_t *map_line_ends;
+
+void usage(FILE *stream, const char *program_name) {
+	fprintf(stream, "%s [-p port] [-l latency_milliseconds]\n", program_name);
+}
+
+void *allocate(size_t size) {
+	void *memory = malloc(size);
+	if(memory == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	return memory;
+}
+
+void make_bodies(void) {
+	// Lines of typical length, every tenth one beginning with a period and so doubled as gopher has it
+	text = allocate(TEXT_SIZE + 128);
+	for(size_t line = 0; text_size < TEXT_SIZE; line++) {
+		text_size += sprintf(text + text_size, "%sLine %zu of the text, with words enough to fill it up to a typical length\r\n", line % 10 == 9 ? ".." : "", line);
+	}
+
+	// Data that doesn't compress, from xorshift
+	binary = allocate(BINARY_SIZE);
+	uint64_t state = 88172645463325252ULL;
+	for(size_t i = 0; i < BINARY_SIZE; i += sizeof(state)) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		memcpy(binary + i, &state, sizeof(state));
+	}
+
+	// Mostly links to text files and directories on the same server, and some informational lines
+	map = allocate(MAP_ENTRIES * 128);
+	map_line_ends = allocate(MAP_ENTRIES * sizeof(*map_line_ends));
+	size_t map_size = 0;
+	for(size_t entry = 0; entry < MAP_ENTRIES; entry++) {
+		if(entry % 8 == 0) {
+			map_size += sprintf(map + map_size, "iSection %zu of the listing\t\terror.host\t1\r\n", entry / 8);
+		} else if(entry % 8 == 1) {
+			map_size += sprintf(map + map_size, "1Directory %zu\t/map/%zu\tlocalhost\t%ld\r\n", entry, entry % 500, port);
+		} else {
+			map_size += sprintf(map + map_size, "0Document number %zu & <more>\t/text/%zu\tlocalhost\t%ld\r\n", entry, 1000 + entry, port);
+		}
+		map_line_ends[entry] = map_size;
+	}
+}
+
+bool write_all(int fd, const char *data, size_t size) {
+	while(size > 0) {
+		ssize_t amount = write(fd, data, size);
+		if(amount == -1 && errno == EINTR) {
+			continue;
+		}
+		if(amount <= 0) {
+			return false;
+		}
+		data += amount;
+		size -= amount;
+	}
+	return true;
+}
+
+void serve(int fd, const char *selector) {
+	char kind[16] = "";
+	unsigned long long int amount = 0;
+	if(sscanf(selector, "%15[a-z]/%llu", kind, &amount) != 2) {
+		const char *error = "3Unknown selector\t\terror.host\t1\r\n.\r\n";
+		write_all(fd, error, strlen(error));
+		return;
+	}
+
+	if(strcmp(kind, "text") == 0) {
+		// Up to the end of the last whole line that fits, repeating the text if need be, then the terminator
+		while(amount > 0) {
+			size_t size = amount < text_size ? amount : text_size;
+			// At least the first line, so the terminator starts a line of its own
+			char *line_end = memrchr(text, '\n', size);
+			if(line_end == NULL) {
+				line_end = memchr(text, '\n', text_size);
+			}
+			size = line_end - text + 1;
+			if(!write_all(fd, text, size)) {
+				return;
+			}
+			amount -= amount < size ? amount : size;
+		}
+		write_all(fd, ".\r\n", 3);
+	} else if(strcmp(kind, "binary") == 0) {
+		while(amount > 0) {
+			size_t size = amount < BINARY_SIZE ? amount : BINARY_SIZE;
+			if(!write_all(fd, binary, size)) {
+				return;
+			}
+			amount -= size;
+		}
+	} else if(strcmp(kind, "map") == 0) {
+		size_t entries = amount < MAP_ENTRIES ? amount : MAP_ENTRIES;
+		if(entries > 0 && !write_all(fd, map, map_line_ends[entries - 1])) {
+			return;
+		}
+		write_all(fd, ".\r\n", 3);
+	} else {
+		const char *error = "3Unknown kind of selector\t\terror.host\t1\r\n.\r\n";
+		write_all(fd, error, strlen(error));
+	}
+}
+
+void *connection_thread(void *arg) {
+	int fd = (int)(intptr_t)arg;
+
+	// The selector is the first line
+	char selector[SELECTOR_MAX];
+	size_t size = 0;
+	while(size < sizeof(selector) - 1) {
+		ssize_t amount = read(fd, selector + size, sizeof(selector) - 1 - size);
+		if(amount <= 0) {
+			close(fd);
+			return NULL;
+		}
+		size += amount;
+		if(memchr(selector, '\n', size) != NULL) {
+			break;
+		}
+	}
+	selector[size] = '\0';
+	selector[strcspn(selector, "\r\n")] = '\0';
+
+	if(latency > 0) {
+		struct timespec delay = {.tv_sec = latency / 1000, .tv_nsec = latency % 1000 * 1000000};
+		nanosleep(&delay, NULL);
+	}
+
+	serve(fd, selector);
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	int option;
+	while((option = getopt(argc, argv, "p:l:h")) != -1) {
+		if(option == 'p') {
+			port = strtol(optarg, NULL, 10);
+		} else if(option == 'l') {
+			latency = strtol(optarg, NULL, 10);
+		} else {
+			usage(option == 'h' ? stdout : stderr, argv[0]);
+			exit(option == 'h' ? 0 : 1);
+		}
+	}
+
+	// Clients, idigna included, may go away in the middle of a body
+	signal(SIGPIPE, SIG_IGN);
+
+	make_bodies();
+
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock == -1) {
+		perror("socket");
+		exit(1);
+	}
+	const int yes = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	if(bind(sock, (struct sockaddr *)&address, sizeof(address)) == -1) {
+		perror("bind");
+		exit(1);
+	}
+	if(listen(sock, 4096) == -1) {
+		perror("listen");
+		exit(1);
+	}
+
+	// A thread per connection keeps it simple, and the latency is then just a sleep
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attributes, 64 * 1024);
+	for(;;) {
+		int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if(fd == -1) {
+			if(errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			perror("accept");
+			sleep(1);
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+		pthread_t thread;
+		if(pthread_create(&thread, &attributes, connection_thread, (void *)(intptr_t)fd) != 0) {
+			close(fd);
+		}
+	}
+}
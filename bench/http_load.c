@@ -0,0 +1,500 @@
+// HTTP load generator for benchmarking idigna: keeps a number of keep-alive connections busy with requests for a while, then reports
+// requests/s, latency percentiles, bytes/s and, given idigna's pid, the CPU time it took per request
+// Paths are picked at random by weight, the same sequence every run, and %n in a path becomes a number unique to the request
+// Run by bench/load.sh as part of `make bench`
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define PATHS_MAX 16
+#define HEADERS_MAX 8
+#define REQUEST_MAX 1024
+#define RESPONSE_HEADER_MAX 8192
+#define READ_SIZE 65536
+
+struct path {
+	const char *path;
+	long int weight;
+};
+
+// Where in the response a connection has got
+enum part { HEADER, BODY, UNTIL_CLOSE, CHUNK_SIZE, CHUNK_DATA, CHUNK_END, TRAILER, DONE };
+
+struct client {
+	int fd;
+
+	char request[REQUEST_MAX];
+	size_t request_size;
+	size_t request_sent;
+	long long int start;
+
+	// Received but not parsed yet, which is never more than a header or chunk size line
+	char buffer[RESPONSE_HEADER_MAX];
+	size_t fill;
+
+	enum part part;
+	long long int left;
+	bool close_after;
+	int status;
+};
+
+long int port = 8080;
+long int number_clients = 64;
+double duration = 5;
+double warmup = 1;
+const char *scenario = "unnamed";
+const char *version = "";
+const char *results_path = NULL;
+pid_t pid = 0;
+
+struct path paths[PATHS_MAX];
+size_t number_paths = 0;
+long int total_weight = 0;
+const char *headers[HEADERS_MAX];
+size_t number_headers = 0;
+
+int epoll_fd;
+uint64_t random_state = 88172645463325252ULL;
+unsigned long long int request_number = 0;
+
+// Measurements, once the warmup is over
+bool measuring = false;
+uint32_t *latencies = NULL;
+size_t number_latencies = 0;
+size_t latencies_allocated = 0;
+unsigned long long int bytes_received = 0;
+unsigned long long int errors = 0;
+
+void usage(FILE *stream, const char *program_name) {
+	fprintf(stream, "%s [-p port] [-c connections] [-d seconds] [-w warmup_seconds] [-s scenario] [-v version] [-o results_file] [-P pid] [-H header]... [weight:]path...\n", program_name);
+}
+
+long long int monotonic_us(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+double cpu_seconds(void) {
+	// User and system time of the process being measured, from /proc/<pid>/stat, where they follow the name and eleven other fields
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%ld/stat", (long int)pid);
+	FILE *file = fopen(path, "r");
+	if(file == NULL) {
+		return 0;
+	}
+	char stat[1024];
+	size_t size = fread(stat, 1, sizeof(stat) - 1, file);
+	fclose(file);
+	stat[size] = '\0';
+
+	char *fields = strrchr(stat, ')');
+	unsigned long long int user = 0, system = 0;
+	if(fields == NULL || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &user, &system) != 2) {
+		return 0;
+	}
+	return (double)(user + system) / sysconf(_SC_CLK_TCK);
+}
+
+void record(long long int latency) {
+	if(number_latencies == latencies_allocated) {
+		latencies_allocated = latencies_allocated == 0 ? 65536 : latencies_allocated * 2;
+		latencies = realloc(latencies, latencies_allocated * sizeof(*latencies));
+		if(latencies == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	latencies[number_latencies++] = latency < UINT32_MAX ? latency : UINT32_MAX;
+}
+
+const char *pick_path(void) {
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+	long int pick = random_state % total_weight;
+	for(size_t i = 0; i < number_paths; i++) {
+		if(pick < paths[i].weight) {
+			return paths[i].path;
+		}
+		pick -= paths[i].weight;
+	}
+	return paths[number_paths - 1].path;
+}
+
+void prepare_request(struct client *client) {
+	// Fill in %n with the number of the request, so requests meant to be told apart aren't coalesced or cached
+	const char *path = pick_path();
+	char expanded[REQUEST_MAX / 2];
+	size_t size = 0;
+	for(const char *c = path; *c != '\0' && size < sizeof(expanded) - 24; c++) {
+		if(c[0] == '%' && c[1] == 'n') {
+			size += sprintf(expanded + size, "%llu", request_number);
+			c++;
+		} else {
+			expanded[size++] = *c;
+		}
+	}
+	expanded[size] = '\0';
+	request_number++;
+
+	client->request_size = snprintf(client->request, sizeof(client->request), "GET %s HTTP/1.1\r\nHost: 127.0.0.1:%ld\r\n", expanded, port);
+	for(size_t i = 0; i < number_headers; i++) {
+		client->request_size += snprintf(client->request + client->request_size, sizeof(client->request) - client->request_size, "%s\r\n", headers[i]);
+	}
+	client->request_size += snprintf(client->request + client->request_size, sizeof(client->request) - client->request_size, "\r\n");
+	client->request_sent = 0;
+	client->part = HEADER;
+	client->fill = 0;
+	client->close_after = false;
+	client->status = 0;
+}
+
+void open_client(struct client *client) {
+	client->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(client->fd == -1) {
+		perror("socket");
+		exit(1);
+	}
+	const int yes = 1;
+	setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+	struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	if(connect(client->fd, (struct sockaddr *)&address, sizeof(address)) == -1 && errno != EINPROGRESS) {
+		perror("connect");
+		exit(1);
+	}
+
+	struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = client};
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &event) == -1) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+}
+
+void start_request(struct client *client, bool new_connection) {
+	// Latency counts from the request being started, connecting included if it takes a new connection
+	if(new_connection) {
+		close(client->fd);
+		open_client(client);
+	}
+	prepare_request(client);
+	client->start = monotonic_us();
+}
+
+void consume(struct client *client, size_t amount) {
+	client->fill -= amount;
+	memmove(client->buffer, client->buffer + amount, client->fill);
+}
+
+bool header_value(const char *header, const char *name, char *value, size_t size) {
+	// Find a header in the response header, case-insensitively, copying its value out
+	size_t name_size = strlen(name);
+	for(const char *line = strstr(header, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+		if(strncasecmp(line + 2, name, name_size) == 0 && line[2 + name_size] == ':') {
+			const char *start = line + 2 + name_size + 1;
+			start += strspn(start, " \t");
+			size_t length = strcspn(start, "\r\n");
+			length = length < size - 1 ? length : size - 1;
+			memcpy(value, start, length);
+			value[length] = '\0';
+			return true;
+		}
+	}
+	return false;
+}
+
+bool parse_response(struct client *client, bool eof) {
+	// Make as much sense of what has been received as there is, returning whether the response is complete
+	for(;;) {
+		if(client->part == HEADER) {
+			client->buffer[client->fill < sizeof(client->buffer) ? client->fill : sizeof(client->buffer) - 1] = '\0';
+			char *end = strstr(client->buffer, "\r\n\r\n");
+			if(end == NULL) {
+				if(client->fill >= sizeof(client->buffer) - 1) {
+					fprintf(stderr, "Response header too large\n");
+					exit(1);
+				}
+				return false;
+			}
+			end[2] = '\0';
+
+			char value[64];
+			client->status = atoi(client->buffer + 9);
+			client->close_after = header_value(client->buffer, "Connection", value, sizeof(value)) && strcasecmp(value, "close") == 0;
+			if(client->status == 304 || client->status == 204) {
+				client->part = DONE;
+			} else if(header_value(client->buffer, "Content-length", value, sizeof(value))) {
+				client->left = atoll(value);
+				client->part = BODY;
+			} else if(header_value(client->buffer, "Transfer-encoding", value, sizeof(value)) && strcasecmp(value, "chunked") == 0) {
+				client->part = CHUNK_SIZE;
+			} else {
+				client->part = UNTIL_CLOSE;
+				client->close_after = true;
+			}
+			consume(client, end + 4 - client->buffer);
+		}
+
+		if(client->part == BODY || client->part == CHUNK_DATA) {
+			size_t amount = client->fill < (size_t)client->left ? client->fill : (size_t)client->left;
+			consume(client, amount);
+			client->left -= amount;
+			if(client->left > 0) {
+				return false;
+			}
+			client->part = client->part == BODY ? DONE : CHUNK_END;
+		}
+
+		if(client->part == UNTIL_CLOSE) {
+			consume(client, client->fill);
+			if(!eof) {
+				return false;
+			}
+			client->part = DONE;
+		}
+
+		if(client->part == CHUNK_SIZE || client->part == CHUNK_END || client->part == TRAILER) {
+			char *line_end = memmem(client->buffer, client->fill, "\r\n", 2);
+			if(line_end == NULL) {
+				return false;
+			}
+			if(client->part == CHUNK_SIZE) {
+				client->left = strtoll(client->buffer, NULL, 16);
+				client->part = client->left > 0 ? CHUNK_DATA : TRAILER;
+			} else if(client->part == CHUNK_END) {
+				client->part = CHUNK_SIZE;
+			} else if(line_end == client->buffer) {
+				// Empty line after the trailer
+				client->part = DONE;
+			}
+			consume(client, line_end + 2 - client->buffer);
+		}
+
+		if(client->part == DONE) {
+			return true;
+		}
+	}
+}
+
+void finish_request(struct client *client) {
+	if(measuring) {
+		record(monotonic_us() - client->start);
+		if(client->status < 200 || client->status >= 400) {
+			errors++;
+		}
+	}
+	start_request(client, client->close_after);
+}
+
+void handle_client(struct client *client) {
+	// Sockets are edge-triggered, so keep going until we would block
+	for(;;) {
+		if(client->request_sent < client->request_size) {
+			ssize_t amount = send(client->fd, client->request + client->request_sent, client->request_size - client->request_sent, MSG_NOSIGNAL);
+			if(amount == -1 && (errno == EAGAIN || errno == ENOTCONN)) {
+				return;
+			}
+			if(amount == -1) {
+				if(measuring) {
+					errors++;
+				}
+				start_request(client, true);
+				continue;
+			}
+			client->request_sent += amount;
+			continue;
+		}
+
+		// Read into the buffer, unless it's a body being counted and thrown away, which is read no further than its end
+		char discard[READ_SIZE];
+		bool into_buffer = client->part != BODY && client->part != CHUNK_DATA && client->part != UNTIL_CLOSE;
+		char *into = into_buffer ? client->buffer + client->fill : discard;
+		size_t room = into_buffer ? sizeof(client->buffer) - 1 - client->fill : sizeof(discard);
+		if(!into_buffer && client->part != UNTIL_CLOSE && (size_t)client->left < room) {
+			room = client->left;
+		}
+		if(!into_buffer && client->fill > 0) {
+			if(parse_response(client, false)) {
+				finish_request(client);
+			}
+			continue;
+		}
+
+		ssize_t amount = recv(client->fd, into, room, 0);
+		if(amount == -1 && errno == EAGAIN) {
+			return;
+		}
+		if(amount <= 0) {
+			// The response runs up to the connection closing, or the connection was closed on us
+			if(client->part == UNTIL_CLOSE && amount == 0) {
+				parse_response(client, true);
+				finish_request(client);
+				client->close_after = false;
+				continue;
+			}
+			if(measuring) {
+				errors++;
+			}
+			start_request(client, true);
+			continue;
+		}
+		if(measuring) {
+			bytes_received += amount;
+		}
+
+		if(into_buffer) {
+			client->fill += amount;
+		} else if(client->part == UNTIL_CLOSE) {
+			continue;
+		} else {
+			client->left -= amount;
+			if(client->left > 0) {
+				continue;
+			}
+			client->part = client->part == BODY ? DONE : CHUNK_END;
+		}
+
+		if(parse_response(client, false)) {
+			finish_request(client);
+		}
+	}
+}
+
+int compare_latencies(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+uint32_t percentile(double fraction) {
+	if(number_latencies == 0) {
+		return 0;
+	}
+	size_t index = fraction * number_latencies;
+	return latencies[index < number_latencies ? index : number_latencies - 1];
+}
+
+int main(int argc, char **argv) {
+	int option;
+	while((option = getopt(argc, argv, "p:c:d:w:s:v:o:P:H:h")) != -1) {
+		if(option == 'p') {
+			port = strtol(optarg, NULL, 10);
+		} else if(option == 'c') {
+			number_clients = strtol(optarg, NULL, 10);
+		} else if(option == 'd') {
+			duration = strtod(optarg, NULL);
+		} else if(option == 'w') {
+			warmup = strtod(optarg, NULL);
+		} else if(option == 's') {
+			scenario = optarg;
+		} else if(option == 'v') {
+			version = optarg;
+		} else if(option == 'o') {
+			results_path = optarg;
+		} else if(option == 'P') {
+			pid = strtol(optarg, NULL, 10);
+		} else if(option == 'H' && number_headers < HEADERS_MAX) {
+			headers[number_headers++] = optarg;
+		} else {
+			usage(option == 'h' ? stdout : stderr, argv[0]);
+			exit(option == 'h' ? 0 : 1);
+		}
+	}
+	for(int i = optind; i < argc && number_paths < PATHS_MAX; i++) {
+		char *colon = strchr(argv[i], ':');
+		bool weighted = colon != NULL && argv[i][0] != '/';
+		paths[number_paths].weight = weighted ? strtol(argv[i], NULL, 10) : 1;
+		paths[number_paths].path = weighted ? colon + 1 : argv[i];
+		total_weight += paths[number_paths].weight;
+		number_paths++;
+	}
+	if(number_paths == 0 || number_clients < 1 || total_weight < 1) {
+		usage(stderr, argv[0]);
+		exit(1);
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(epoll_fd == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	struct client *clients = calloc(number_clients, sizeof(struct client));
+	if(clients == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for(long int i = 0; i < number_clients; i++) {
+		open_client(&clients[i]);
+		start_request(&clients[i], false);
+	}
+
+	// Run through the warmup, then measure for the duration
+	long long int start = monotonic_us();
+	long long int measure_start = start + warmup * 1e6;
+	long long int end = measure_start + duration * 1e6;
+	double cpu_start = 0;
+	struct epoll_event events[256];
+	for(;;) {
+		long long int now = monotonic_us();
+		if(!measuring && now >= measure_start) {
+			measuring = true;
+			cpu_start = pid != 0 ? cpu_seconds() : 0;
+		}
+		if(now >= end) {
+			break;
+		}
+
+		int timeout = (measuring ? end : measure_start) - now;
+		int ready = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(*events), timeout / 1000 + 1);
+		if(ready == -1 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(1);
+		}
+		for(int i = 0; i < ready; i++) {
+			handle_client(events[i].data.ptr);
+		}
+	}
+	double cpu = pid != 0 ? cpu_seconds() - cpu_start : 0;
+
+	qsort(latencies, number_latencies, sizeof(*latencies), compare_latencies);
+	double requests_per_second = number_latencies / duration;
+	double bytes_per_second = bytes_received / duration;
+	double cpu_per_request = number_latencies > 0 ? cpu * 1e6 / number_latencies : 0;
+
+	printf("%-16s %9.0f requests/s %9.1f MiB/s  p50 %7u us  p99 %7u us  p99.9 %7u us  max %7u us", scenario, requests_per_second, bytes_per_second / (1 << 20), percentile(0.5), percentile(0.99), percentile(0.999), percentile(1));
+	if(pid != 0) {
+		printf("  %6.1f us CPU/request", cpu_per_request);
+	}
+	if(errors > 0) {
+		printf("  %llu errors", errors);
+	}
+	printf("\n");
+
+	// One JSON object per line, appended, so results of different runs and versions can be put side by side
+	if(results_path != NULL) {
+		FILE *results = fopen(results_path, "a");
+		if(results == NULL) {
+			perror("fopen");
+			exit(1);
+		}
+		fprintf(results, "{\"scenario\": \"%s\", \"version\": \"%s\", \"time\": %lld, \"connections\": %ld, \"duration_s\": %g, \"requests\": %zu, \"errors\": %llu, \"requests_per_s\": %.1f, \"bytes_per_s\": %.0f, \"latency_p50_us\": %u, \"latency_p99_us\": %u, \"latency_p999_us\": %u, \"latency_max_us\": %u, \"cpu_us_per_request\": %.2f}\n",
+			scenario, version, (long long int)time(NULL), number_clients, duration, number_latencies, errors, requests_per_second, bytes_per_second, percentile(0.5), percentile(0.99), percentile(0.999), percentile(1), cpu_per_request);
+		fclose(results);
+	}
+	return 0;
+}
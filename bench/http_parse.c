@@ -0,0 +1,64 @@
+// Microbenchmark of parsing requests: a typical browser request, arriving whole and a few bytes at a time
+// Run with `make bench`
+
+// idigna's main() never returns, which only main() itself gets away with
+#pragma GCC diagnostic ignored "-Wreturn-type"
+#define main idigna_main
+#include "../idigna.c"
+#undef main
+
+#define REQUESTS 2000000
+
+const char browser_request[] =
+	"GET /1/software/gopher%20clients HTTP/1.1\r\n"
+	"Host: proxy.example.org:8080\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-GB,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"Connection: keep-alive\r\n"
+	"Referer: http://proxy.example.org:8080/1/software\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"If-None-Match: \"5f3a-1c\"\r\n"
+	"Priority: u=0, i\r\n"
+	"\r\n";
+
+double seconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void bench_parse(const char *name, size_t piece) {
+	// Parse the request again and again, handing the parser `piece` more bytes each call like recv() would
+	char buffer[sizeof(browser_request)];
+	size_t size = sizeof(browser_request) - 1;
+	size_t calls = 0;
+	size_t path_size = 0;
+
+	double start = seconds();
+	for(int i = 0; i < REQUESTS; i++) {
+		memcpy(buffer, browser_request, size);
+		struct request request = {0};
+		enum parse_result result = PARSE_INCOMPLETE;
+		for(size_t available = piece; result == PARSE_INCOMPLETE; available += piece) {
+			result = parse_request(&request, buffer, available < size ? available : size);
+			calls++;
+		}
+		if(result != PARSE_DONE) {
+			fprintf(stderr, "%s: parse failed\n", name);
+			exit(1);
+		}
+		path_size += percent_decode(request.target.data, request.target.size);
+	}
+	double elapsed = seconds() - start;
+
+	printf("%-12s %8.2f M requests/s %8.1f MiB/s (%.1f calls per request, %zu bytes of paths)\n", name, REQUESTS / elapsed / 1e6, (double)size * REQUESTS / elapsed / (1 << 20), (double)calls / REQUESTS, path_size / REQUESTS);
+}
+
+int main(void) {
+	bench_parse("whole", sizeof(browser_request));
+	bench_parse("64 bytes", 64);
+	bench_parse("8 bytes", 8);
+	return 0;
+}
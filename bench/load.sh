@@ -0,0 +1,77 @@
+#!/bin/bash
+# Load test of idigna as built, against the mock gopher server, one scenario after another
+# Run with `make bench`; every scenario appends a line of JSON to $RESULTS (default bench/results.json)
+# DURATION and WARMUP set how many seconds each scenario measures for, after warming up, and CONNECTIONS how many clients it has
+
+set -e
+cd "$(dirname "$0")/.."
+
+RESULTS=${RESULTS:-bench/results.json}
+DURATION=${DURATION:-5}
+WARMUP=${WARMUP:-1}
+CONNECTIONS=${CONNECTIONS:-64}
+GOPHER_PORT=${GOPHER_PORT:-17070}
+PROXY_PORT=${PROXY_PORT:-18080}
+VERSION=$(git describe --always --dirty 2>/dev/null || echo unknown)
+
+mock_pid=
+proxy_pid=
+stop() {
+	for pid in $proxy_pid $mock_pid; do
+		kill "$pid" 2>/dev/null || true
+		wait "$pid" 2>/dev/null || true
+	done
+	proxy_pid=
+	mock_pid=
+}
+trap stop EXIT INT TERM
+
+wait_for_port() {
+	# Until something accepts connections on the port
+	tries=0
+	until (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null || [ $tries -ge 50 ]; do
+		sleep 0.1
+		tries=$((tries + 1))
+	done
+}
+
+# scenario name latency_ms "idigna options" "http_load options" paths...
+scenario() {
+	name=$1
+	latency=$2
+	proxy_options=$3
+	load_options=$4
+	shift 4
+
+	bench/gopher_mock -p "$GOPHER_PORT" -l "$latency" &
+	mock_pid=$!
+	./idigna -p "$PROXY_PORT" $proxy_options 127.0.0.1 "$GOPHER_PORT" &
+	proxy_pid=$!
+	wait_for_port "$GOPHER_PORT"
+	wait_for_port "$PROXY_PORT"
+
+	bench/http_load -p "$PROXY_PORT" -c "$CONNECTIONS" -d "$DURATION" -w "$WARMUP" -s "$name" -v "$VERSION" -o "$RESULTS" -P "$proxy_pid" $load_options "$@"
+	stop
+}
+
+echo "Load tests of $VERSION, $CONNECTIONS connections for ${DURATION}s each, results in $RESULTS:"
+
+# Every request fetched from the remote, each path told apart so nothing is coalesced
+scenario text-4k 0 "" "" "/0text/4096/%n"
+scenario text-1m 0 "" "" "/0text/1048576/%n"
+scenario gophermap-200 0 "" "" "/1map/200/%n"
+scenario binary-64k 0 "" "" "/9binary/65536/%n"
+scenario binary-4m 0 "" "" "/9binary/4194304/%n"
+scenario mix 0 "" "" "6:/1map/100/%n" "3:/0text/16384/%n" "1:/9binary/262144/%n"
+
+# Compression of text and gophermaps on the way
+scenario text-4k-gzip 0 "" "-H Accept-Encoding:gzip" "/0text/4096/%n"
+scenario gophermap-200-gzip 0 "" "-H Accept-Encoding:gzip" "/1map/200/%n"
+
+# A slow remote, with every connection waiting on it at once
+scenario latency-50ms 50 "" "" "/0text/4096/%n"
+
+# The same few paths over and over: coalesced while in flight, and served from the cache
+scenario coalesced 50 "" "" "/0text/65536/a" "/0text/65536/b"
+scenario cached 0 "--cache-size 67108864" "" "/0text/4096/a" "/1map/200/b" "/9binary/65536/c"
+scenario cached-gzip 0 "--cache-size 67108864" "-H Accept-Encoding:gzip" "/0text/4096/a" "/1map/200/b"
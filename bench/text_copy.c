@@ -0,0 +1,182 @@
+// Microbenchmark of sending text bodies: finding lines beginning with a period, and the batched path against sending line by line
+// Run with `make bench`
+
+// idigna's main() never returns, which only main() itself gets away with
+#pragma GCC diagnostic ignored "-Wreturn-type"
+#define main idigna_main
+#include "../idigna.c"
+#undef main
+
+#define BODY_SIZE (64 * 1024 * 1024)
+#define ROUNDS 5
+
+char *body;
+size_t body_size;
+
+double seconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void make_body(void) {
+	// Short lines, every tenth one dot-stuffed, ending with the terminator
+	body = malloc(BODY_SIZE + 16);
+	if(body == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	size_t line = 0;
+	while(body_size < BODY_SIZE) {
+		body_size += sprintf(body + body_size, line % 10 == 0 ? "..line %zu\r\n" : "line %zu of text\r\n", line);
+		line++;
+	}
+	memcpy(body + body_size, ".\r\n", 3);
+	body_size += 3;
+}
+
+void bench_scanner(const char *name, size_t (*scan)(const char *data, size_t size)) {
+	// Count the lines beginning with a period in the whole body
+	double start = seconds();
+	size_t found = 0;
+	for(int round = 0; round < ROUNDS; round++) {
+		size_t offset = 0;
+		for(;;) {
+			size_t position = offset + scan(body + offset, body_size - offset);
+			if(position >= body_size) {
+				break;
+			}
+			found++;
+			offset = position + 1;
+		}
+	}
+	double elapsed = seconds() - start;
+	printf("%-8s %8.1f MiB/s (%zu found)\n", name, (double)body_size * ROUNDS / elapsed / (1 << 20), found / ROUNDS);
+}
+
+ssize_t per_line_stream_to_client(struct connection *conn) {
+	// Text copying as it was before batching, sending one line at a time
+	size_t skipped = 0;
+
+	if(conn->beginning_of_line) {
+		char peek[3];
+		size_t peeked = ring_peek(&conn->ring, 0, peek, sizeof(peek));
+
+		if(peeked >= 2 && memcmp(peek, "..", 2) == 0) {
+			ring_consume(&conn->ring, 1);
+			skipped = 1;
+			conn->beginning_of_line = false;
+		} else if(peeked == 3 && memcmp(peek, ".\r\n", 3) == 0) {
+			conn->remote_eof = true;
+			ring_consume(&conn->ring, conn->ring.fill);
+			return 3;
+		} else if(peeked < 3 && memcmp(peek, ".\r\n", peeked) == 0 && !conn->remote_eof) {
+			return 0;
+		}
+
+		if(conn->ring.fill == 0) {
+			return skipped;
+		}
+	}
+
+	struct iovec iov[2];
+	ring_data_iov(&conn->ring, iov);
+	char *start = iov[0].iov_base;
+	char *end = memchr(start, '\n', iov[0].iov_len);
+	size_t left = end == NULL ? iov[0].iov_len : (size_t)(end - start + 1);
+
+	ssize_t amount = send(conn->client.fd, start, left, MSG_NOSIGNAL);
+	if(amount == -1) {
+		return skipped > 0 ? (ssize_t)skipped : -1;
+	}
+	if(amount > 0) {
+		conn->beginning_of_line = start[amount - 1] == '\n';
+	}
+	ring_consume(&conn->ring, amount);
+	return amount + skipped;
+}
+
+void *drain(void *arg) {
+	// Read and throw away whatever gets sent, counting it
+	int fd = *(int *)arg;
+	static char sink[1 << 16];
+	size_t total = 0;
+	ssize_t amount;
+	while((amount = read(fd, sink, sizeof(sink))) > 0) {
+		total += amount;
+	}
+	return (void *)total;
+}
+
+void bench_send(const char *name, ssize_t (*send_text)(struct connection *conn)) {
+	int pair[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+		perror("socketpair");
+		exit(1);
+	}
+	pthread_t thread;
+	pthread_create(&thread, NULL, drain, &pair[1]);
+
+	struct connection conn;
+	memset(&conn, 0, sizeof(conn));
+	conn.copymode = TEXT;
+	conn.client.fd = pair[0];
+	conn.capture_fd = -1;
+	conn.beginning_of_line = true;
+	char *ring_memory = malloc(ring_size);
+	if(ring_memory == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	ring_setup(&conn.ring, ring_memory, ring_size);
+
+	// Feed the body through the ring buffer as the remote would, and send it on until the terminator
+	double start = seconds();
+	size_t fed = 0;
+	size_t calls = 0;
+	while(!conn.remote_eof) {
+		struct iovec iov[2];
+		int iovcnt = ring_free_iov(&conn.ring, iov);
+		for(int i = 0; i < iovcnt; i++) {
+			size_t amount = body_size - fed < iov[i].iov_len ? body_size - fed : iov[i].iov_len;
+			memcpy(iov[i].iov_base, body + fed, amount);
+			conn.ring.fill += amount;
+			fed += amount;
+		}
+
+		while(conn.ring.fill > 0 && !conn.remote_eof) {
+			calls++;
+			if(send_text(&conn) <= 0) {
+				break;
+			}
+		}
+	}
+	double elapsed = seconds() - start;
+
+	close(pair[0]);
+	void *received;
+	pthread_join(thread, &received);
+	close(pair[1]);
+	free(ring_memory);
+
+	printf("%-8s %8.1f MiB/s, %zu sends, %zu bytes out\n", name, (double)body_size / elapsed / (1 << 20), calls, (size_t)received);
+}
+
+int main(void) {
+	make_body();
+	setup_find_newline_period();
+
+	printf("Finding lines beginning with a period:\n");
+	bench_scanner("scalar", find_newline_period_scalar);
+#if defined(__x86_64__) || defined(__i386__)
+	bench_scanner("sse2", find_newline_period_sse2);
+	if(__builtin_cpu_supports("avx2")) {
+		bench_scanner("avx2", find_newline_period_avx2);
+	}
+#endif
+
+	printf("Sending through a %ld byte ring buffer:\n", ring_size);
+	bench_send("per line", per_line_stream_to_client);
+	bench_send("batched", stream_to_client);
+	return 0;
+}
@@ -1,4 +1,4 @@
-#define _GNU_SOURCE // For memrchr
+#define _GNU_SOURCE // For memrchr, accept4
 
 #include <getopt.h>
 #include <stdio.h>
@@ -10,6 +10,7 @@
 #include <sys/stat.h>
 #include <libgen.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -17,7 +18,77 @@
 #include <stddef.h>
 #include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <stdatomic.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Static tracepoints for bpftrace and perf, each just a nop until a tracer attaches to it, and left out entirely without sys/sdt.h
+// Probes are idigna:accept, state, remote_send, remote_receive, remote_close, response and close, all with the connection id first
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT
+#endif
+#endif
+#ifdef HAVE_SDT
+#define TRACE2(name, a, b) DTRACE_PROBE2(idigna, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(idigna, name, a, b, c)
+#define TRACE5(name, a, b, c, d, e) DTRACE_PROBE5(idigna, name, a, b, c, d, e)
+#else
+#define TRACE2(name, a, b) do {} while(0)
+#define TRACE3(name, a, b, c) do {} while(0)
+#define TRACE5(name, a, b, c, d, e) do {} while(0)
+#endif
+
+// Maximum number of events handled per wakeup of the event loop
+#define MAX_EVENTS 256
+
+// Maximum number of empty pipes kept around for splicing
+#define PIPE_POOL_SIZE 64
+
+// Layout of the disk cache index: number of slots and the longest selector that fits in one
+#define DISK_CACHE_MAGIC 0x696469676e610003ULL
+#define DISK_CACHE_SLOTS 16384
+#define DISK_CACHE_NO_SLOT DISK_CACHE_SLOTS
+
+// Slots in use are kept to three quarters, so probing for a selector that isn't cached ends at a free slot soon
+#define DISK_CACHE_MAX_USED (DISK_CACHE_SLOTS / 4 * 3)
+#define DISK_CACHE_SELECTOR_MAX 216
+
+// Most pieces a text body is sent in at once, each running up to a period removed from the beginning of a line
+#define TEXT_IOV_MAX 64
+
+// Longest request accepted from a client, up to and including the empty line after the headers
+#define REQUEST_MAX 8192
+#define ARENA_SIZE 1024
+
+// Number of buckets in the hash table of fetches in progress
+#define FLIGHT_BUCKETS 1024
+
+// Longest gophermap line translated, anything beyond that is cut off
+#define GOPHERMAP_LINE_MAX 4096
+
+// Compressed body held by a connection until it's sent, and the most encoders kept around for reuse
+#define ENCODER_OUT 16384
+#define ENCODER_POOL_SIZE 64
 
 long int server_port = 80;
 
@@ -43,42 +114,684 @@ struct { const char *ext; const char *mimetype; } extension_mimetypes[] = {
 };
 
 const char *program_name;
-const char *remote;
-long int remote_port = 70;
-char remote_port_string[6];
 
+// Event engine used to wait on sockets: edge-triggered epoll by default, with plain poll() as a fallback
+enum engine { EPOLL_ENGINE, POLL_ENGINE };
+enum engine engine = EPOLL_ENGINE;
+
+// Every socket registered with the event engine has a handle, which is what the engine gives back when the socket is ready
+// This lets us get from a ready socket to its connection without searching for it
+enum handle_type { LISTEN_HANDLE, CLIENT_HANDLE, REMOTE_HANDLE, RESOLVER_HANDLE, PROBE_HANDLE };
+struct connection;
+struct handle {
+	enum handle_type type;
+	int fd;
+
+	// Events we're currently waiting for, and the events we were last woken up with, in poll() terms
+	short events;
+	short revents;
+
+	// Index in the table of sockets, only used by the poll engine
+	size_t socket_index;
+
+	// Connection the socket belongs to, NULL for sockets not belonging to any connection
+	struct connection *conn;
+};
+
+// A ready socket, as returned by wait_events()
+struct event {
+	struct handle *handle;
+	short revents;
+};
+
+// Listening sockets, in the order they were set up
+struct handle **listeners = NULL;
+size_t number_listeners = 0;
+
+// Listening sockets of this process, and whether they're being accepted from
+// Accepting pauses at max_connections connections across all workers, or when running out of file descriptors, and is retried every ACCEPT_RETRY ms
+#define ACCEPT_RETRY 100
+long int listen_backlog = 4096;
+long int max_connections = 0; // 0 for no limit
+size_t first_own_listener = 0;
+size_t number_own_listeners = 0;
+bool accepting = true;
+bool accept_exhausted = false; // Only warn once about running out
+long long int accept_retry = 0;
+
+// Worker processes, each with its own set of SO_REUSEPORT listening sockets, if running with --workers
+struct worker {
+	pid_t pid;
+	time_t started;
+
+	// Range of the worker's sockets in the table of listening sockets
+	size_t first_listener;
+	size_t number_listeners;
+};
+long int workers = 0;
+struct worker *worker_table = NULL;
+volatile sig_atomic_t stop_requested = 0;
+
+// State of the epoll engine
+int epoll_fd = -1;
+
+// State of the poll engine: table of sockets to pass to poll() and the handles corresponding to them
 struct pollfd *sockets = NULL;
+struct handle **socket_handles = NULL;
 size_t number_sockets = 0;
-size_t number_interfaces = 0;
+size_t sockets_allocated = 0;
 
-enum connection_state { START, PATH, REQUEST_END, CONNECT, REQUEST_WRITE, HEADER_WRITE, READ, WRITE };
+enum connection_state { START, CONNECT, RESOLVING, CONNECTING, REQUEST_WRITE, HEADER_WRITE, STREAM, LAST_CHUNK_WRITE, CACHE_WRITE, FLIGHT_WRITE, FILE_WRITE, RESPONSE_WRITE, NUMBER_STATES };
+const char *state_names[NUMBER_STATES] = {"start", "connect", "resolving", "connecting", "request_write", "header_write", "stream", "last_chunk_write", "cache_write", "flight_write", "file_write", "response_write"};
 enum copymode { TEXT, BINARY, GOPHERMAP };
+
+// Content codings a response body can be sent in, deflate meaning the zlib format as HTTP has it
+enum content_encoding { IDENTITY, GZIP, DEFLATE, NUMBER_ENCODINGS };
+const char *encoding_headers[NUMBER_ENCODINGS] = {"", "Content-encoding: gzip\r\n", "Content-encoding: deflate\r\n"};
+
+// Ring buffer the response body streams through from the remote to the client
+struct ring {
+	char *data;
+	size_t size;
+
+	// Index of the first byte of data, and the amount of data
+	size_t start;
+	size_t fill;
+};
+
+// Response body cached in memory, keyed by itemtype and selector
+struct cache_entry {
+	char itemtype;
+	char *selector;
+	size_t selector_size;
+
+	char *body;
+	size_t body_size;
+	long long int expires;
+
+	// Validators: checksum of the body, and wall clock time it was fetched
+	uint32_t checksum;
+	time_t stored;
+
+	// Body compressed for clients that want it that way, made on the first hit asking for it
+	char *encoded[NUMBER_ENCODINGS];
+	size_t encoded_size[NUMBER_ENCODINGS];
+
+	// Connections serving the entry, which keep it alive even if it gets evicted meanwhile
+	size_t references;
+	bool cached;
+
+	// Prefetched and not asked for yet
+	bool prefetched;
+
+	// Chain in the hash table bucket, and neighbours in the LRU list
+	struct cache_entry *hash_next;
+	struct cache_entry *lru_prev;
+	struct cache_entry *lru_next;
+};
+
+// Index of the disk cache, which is a file mapped into memory as it is, so it survives restarts
+// It's a hash table of slots with linear probing, and each object is stored in its own file named after the slot's file id
+// The slots in use are also linked into a list from most to least recently used, by slot index
+struct disk_cache_slot {
+	uint64_t hash;
+	uint64_t file_id;
+	uint64_t size;
+
+	// Wall clock time rather than monotonic, as the index outlives the process
+	int64_t expires;
+	int64_t last_used;
+	int64_t stored;
+
+	uint8_t used;
+	char itemtype;
+	uint16_t selector_size;
+	uint32_t checksum;
+	uint32_t lru_prev;
+	uint32_t lru_next;
+	char selector[DISK_CACHE_SELECTOR_MAX];
+};
+
+struct disk_cache_index {
+	uint64_t magic;
+	uint32_t slot_size;
+	uint32_t number_slots;
+	uint64_t next_file_id;
+
+	// Slots in use and the bytes of their objects, so storing never has to count them, and the ends of the LRU list
+	uint64_t used_slots;
+	uint64_t bytes;
+	uint32_t lru_head;
+	uint32_t lru_tail;
+
+	struct disk_cache_slot slots[DISK_CACHE_SLOTS];
+};
+
+// Gophermap being translated into HTML a line at a time as it streams through
+struct gophermap {
+	// Line being collected from the ring buffer, without the \n
+	char line[GOPHERMAP_LINE_MAX];
+	size_t line_size;
+	bool line_overflow;
+
+	// HTML translated so far and not yet written to the client
+	char *html;
+	size_t html_size;
+	size_t html_allocated;
+	size_t html_written;
+
+	// Whether the end of the listing has been translated, footer and all
+	bool finished;
+
+	// Links queued for prefetching so far
+	long int prefetched;
+};
+
+// Fetch from the remote shared by concurrent requests for the same itemtype and selector
+// The leading connection fetches the body and, once another joins, keeps what it sends its own client, the others follow it each at their own offset
+struct flight {
+	char itemtype;
+	char *selector;
+	size_t selector_size;
+	size_t selector_allocated;
+
+	// Body as sent to the clients, starting at offset base, before which every follower has already sent it
+	char *data;
+	size_t data_size;
+	size_t data_allocated;
+	size_t base;
+
+	// Nothing is kept until the first request joins, before that the leader's capture for the cache has the body so far if anything does
+	bool buffered;
+
+	// Requests can join for as long as the whole body so far is kept
+	bool joinable;
+	bool complete;
+	bool failed;
+
+	struct connection *leader;
+	struct connection *followers;
+	size_t references;
+
+	bool hashed;
+	struct flight *hash_next;
+
+	// Flights are reused rather than freed, like connections
+	struct flight *next_free;
+};
+
+// Compression of a response body as it's sent: the state of the compression, and output that hasn't gone out yet
+struct encoder {
+	z_stream stream;
+	enum content_encoding encoding;
+
+	// Whether any of the body has gone in since the last flush, and whether the end of the compressed body has been produced
+	bool unflushed;
+	bool finished;
+
+	char out[ENCODER_OUT];
+	size_t out_size;
+	size_t out_written;
+};
+
+// Pipe binary response bodies get spliced through from the remote to the client, without copying them to userspace
+struct pipe_pair {
+	int read_fd;
+	int write_fd;
+	size_t size;
+};
+
+// Part of the request buffer
+struct slice {
+	char *data;
+	size_t size;
+};
+
+// Request being parsed in place: the parts of it we care about, and how far parsing has got
+struct request {
+	struct slice method;
+	struct slice target;
+	struct slice version;
+
+	struct slice host;
+	struct slice connection;
+	struct slice accept_encoding;
+	struct slice if_none_match;
+	struct slice if_modified_since;
+	struct slice range;
+	struct slice if_range;
+
+	// Length of the lines parsed so far, and of the whole request once it's complete
+	size_t parsed;
+	size_t size;
+};
+
+enum parse_result { PARSE_INCOMPLETE, PARSE_DONE, PARSE_ERROR };
+
+struct { const char *name; size_t offset; } request_headers[] = {
+	{"Host", offsetof(struct request, host)},
+	{"Connection", offsetof(struct request, connection)},
+	{"Accept-Encoding", offsetof(struct request, accept_encoding)},
+	{"If-None-Match", offsetof(struct request, if_none_match)},
+	{"If-Modified-Since", offsetof(struct request, if_modified_since)},
+	{"Range", offsetof(struct request, range)},
+	{"If-Range", offsetof(struct request, if_range)},
+};
+
+// Timer wheel: timers expire in ticks, and live in one of the slots of one of the levels depending on how far off they are
+// Each level covers WHEEL_SLOTS times the span of the one below it, and its timers cascade down as the time they're due in comes round
+#define TIMER_TICK 10 // In milliseconds
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+struct timer {
+	long long int expires;
+	struct timer *next;
+	struct timer **pprev;
+	struct connection *conn;
+};
+struct {
+	struct timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	long long int tick;
+	size_t armed;
+} wheel;
+
+// What a connection is waiting for, and so which timeout applies
+enum timeout { NO_TIMEOUT, HEADER_TIMEOUT, CONNECT_TIMEOUT, REMOTE_TIMEOUT, CLIENT_TIMEOUT, NUMBER_TIMEOUTS };
+const char *timeout_names[NUMBER_TIMEOUTS] = {"none", "header", "connect", "remote", "client"};
+
 struct connection {
 	enum connection_state state;
 
-	int sock;
-	int sock_other;
+	// Number of the connection within the worker, for telling connections apart when tracing
+	unsigned long long int id;
 
-	char *path;
+	// Fetching an item into the cache before any client asks for it, so there's no client to send it to
+	bool prefetch;
+
+	struct handle client;
+	struct handle remote;
+
+	// Request as received from the client, possibly followed by the beginning of further pipelined requests
+	char request_buffer[REQUEST_MAX];
+	size_t request_size;
+	struct request request;
+
+	// HTTP version of the request, and whether the connection stays open for another request after the response
+	int http_minor;
+	bool keep_alive;
+	bool head;
+
+	// Selector, within the request buffer
+	const char *path;
 	size_t path_size;
 
+	// Timing of the request for the metrics, in microseconds, and what has been sent to the client so far
+	long long int request_start;
+	long long int connect_start;
+	bool first_byte;
+	long long int first_byte_latency;
+	unsigned long long int bytes_sent;
+	bool completed;
+	int status;
+
+	// Where the client connected from, for the access log
+	struct sockaddr_storage client_address;
+	socklen_t client_address_size;
+
+	// Response generated by idigna itself, sent after the header in the buffer
+	char *response_body;
+	size_t response_body_size;
+
+	// Strings that only live as long as the request, such as the response header, bump-allocated and all let go of at once
+	char arena[ARENA_SIZE];
+	size_t arena_used;
+
 	char itemtype;
 	enum copymode copymode;
 
+	// Content coding the body is sent in, and the encoder compressing it if it's streamed
+	enum content_encoding encoding;
+	struct encoder *encoder;
+
+	// Validators of a body known up front, i.e. cached: checksum and length of it as it is, and when it was fetched
+	bool validated;
+	uint32_t checksum;
+	off_t checksum_size;
+	time_t modified;
+
+	// Part of a body known up front that's sent, all of it unless asked for a range
+	off_t range_start;
+	off_t range_end;
+
 	char *buffer;
 	size_t buffer_size;
-
 	size_t written;
-	size_t read;
+
+	// Response body, being read from the remote and written to the client at the same time
+	// Goes through the pipe if splicing, otherwise through the ring buffer
+	struct ring ring;
+	char *ring_memory;
+	struct pipe_pair pipe_pair;
+	size_t pipe_fill;
+	bool remote_eof;
+	bool paused;
 	bool beginning_of_line;
+	struct gophermap *gophermap;
+	struct gophermap *gophermap_memory;
+
+	// Chunked framing of a streamed response: how much of the current chunk is left, and framing still to be sent ahead of the body
+	bool chunked;
+	size_t chunk_left;
+	char frame[32];
+	size_t frame_size;
+	size_t frame_written;
+
+	// Copy of the body as sent to the client, kept for storing in the cache once complete
+	// Large bodies get spilled into a temporary file for the disk cache
+	bool capturing;
+	uint32_t capture_checksum;
+	char *capture;
+	size_t capture_size;
+	size_t capture_allocated;
+	int capture_fd;
+	char *capture_path;
+
+	// Cache entry or cached file being served
+	struct cache_entry *cache_entry;
+	int file_fd;
+	off_t file_offset;
+	off_t file_size;
+
+	// Fetch shared with other requests, which this connection either leads or follows
+	struct flight *flight;
+	size_t flight_offset;
+	bool flight_waiting;
+	struct connection *follower_prev;
+	struct connection *follower_next;
+
+	// Backend the request is passed on to, and those it has already failed on
+	struct backend *backend;
+	uint64_t backends_tried;
+
+	// Addresses of the remote being tried, the one being connected to and where to continue if that fails
+	struct address_list *addresses;
+	struct addrinfo *current_address;
+	struct addrinfo *first_address;
+	struct addrinfo *next_address;
+	bool started_addresses;
+	bool timed_out;
+
+	// Position in the list of connections waiting for addresses
+	bool resolving;
+	struct connection *resolving_prev;
+	struct connection *resolving_next;
+
+	// Timeout of whatever the connection is waiting for
+	enum timeout timeout;
+	struct timer timer;
+
+	// Woken up by another connection, to be handled once the current batch of events has been
+	bool woken;
+	struct connection *next_woken;
+
+	// Removed connections are only put back into the pool once the current batch of events has been handled, as later events in it may still point to them
+	bool closed;
+	struct connection *next_closed;
+	struct connection *next_free;
+};
+
+struct connection *closed_connections = NULL;
+unsigned long long int last_connection_id = 0;
+struct connection *woken_connections = NULL;
+
+// Addresses of a backend, as resolved by the resolver thread
+// Only touched by the event loop, which frees a list once it has been replaced and no connection is using it anymore
+struct address_list {
+	struct addrinfo *addresses;
+
+	// Address last connected to successfully, which gets tried first
+	struct addrinfo *preferred;
+
+	// Connections trying addresses from the list, plus one while it is the current list
+	size_t references;
 };
+long int resolve_ttl = 60; // In seconds
 
-struct connection **connections = NULL;
-size_t number_connections = 0;
+// Gopher servers the requests are passed on to, all serving the same items, in the order given
+#define BACKENDS_MAX 64
+struct backend {
+	const char *host;
+	long int port;
+	char port_string[6];
+	char name[NI_MAXHOST + 8];
+	uint64_t hash;
+
+	// Current addresses, and a result of the resolver thread the event loop hasn't picked up yet
+	struct address_list *addresses;
+	struct addrinfo *resolved_addresses;
+	bool resolved;
+	bool lookup_failed;
+
+	// Backends failing HEALTH_FAILURES times in a row, connecting to them or probing them, are ejected until a probe succeeds again
+	bool healthy;
+	int failures;
+
+	// Health probe in progress: an empty selector, which a gopher server answers with its root menu
+	struct handle probe;
+	bool probe_sent;
+	long long int probe_deadline;
+};
+struct backend backends[BACKENDS_MAX];
+size_t number_backends = 0;
+
+// How a backend is chosen for a request: the one with the fewest requests in progress, or by a hash of the selector, so every item keeps going to the same backend and stays in its cache
+enum balance { LEAST_CONNECTIONS, SELECTOR_HASH };
+enum balance balance = LEAST_CONNECTIONS;
+size_t last_backend = 0;
+
+// Backends are probed every health_interval seconds, which also brings ejected ones back
+#define HEALTH_FAILURES 3
+long int health_interval = 5; // 0 for no probes
+long long int next_probes = 0;
+
+// Handover of results from the resolver thread, which signals new ones on resolver_handle
+pthread_mutex_t resolver_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t resolver_cond;
+bool refresh_requested = false;
+struct handle resolver_handle = {.type = RESOLVER_HANDLE, .fd = -1, .events = POLLIN};
+
+// Connections waiting for addresses
+struct connection *resolving_head = NULL;
+struct connection *resolving_tail = NULL;
+
+// How long a client may take to send a request, the remote to connect, and either side to make progress when we're waiting on it
+long int header_timeout = 30; // In seconds
+long int connect_timeout = 5000; // In milliseconds
+long int remote_timeout = 60; // In seconds
+long int client_timeout = 60; // In seconds
+
+// Size of the ring buffer of each connection
+// Reading from the remote stops once the buffer fills up to the high watermark, and continues once the client has drained it down to the low watermark
+long int ring_size = 65536;
+long int high_watermark = -1; // Defaults to ring_size
+long int low_watermark = -1; // Defaults to half of high_watermark
+
+// Pool of connections, allocated in slabs together with their ring buffers and reused instead of freed
+// Each worker allocates pool_size connections up front, and more only if there are ever more connections at the same time
+#define POOL_SLAB 64
+struct connection *free_connections = NULL;
+size_t pool_connections = 0;
+long int pool_size = 256;
+
+// Response cache: hash table of entries, LRU list to evict from when over the byte budget, and statistics
+// A cache size of 0 disables the cache, TTLs are per itemtype with -1 meaning the default TTL
+struct {
+	struct cache_entry **buckets;
+	size_t number_buckets;
+	size_t number_entries;
+
+	// Most and least recently used entries
+	struct cache_entry *lru_head;
+	struct cache_entry *lru_tail;
+
+	size_t bytes;
+	unsigned long long int hits;
+	unsigned long long int misses;
+	unsigned long long int stores;
+	unsigned long long int evictions;
+} cache;
+long int cache_size = 0;
+long int cache_max_object = 1 << 20;
+long int cache_default_ttl = 60; // In seconds
+long int cache_ttls[256];
+volatile sig_atomic_t stats_requested = 0;
+
+// Disk cache for objects too large for the memory cache, in a directory of its own for every worker
+const char *disk_cache_root = NULL;
+char *disk_cache_dir = NULL;
+long int disk_cache_size = 1L << 30;
+long int disk_cache_max_object = 256L << 20;
+struct {
+	struct disk_cache_index *index;
+	unsigned long long int temporary_files;
+	unsigned long long int hits;
+	unsigned long long int misses;
+	unsigned long long int stores;
+	unsigned long long int evictions;
+} disk_cache;
+long int worker_index = 0;
+
+// Fetches in progress, which concurrent requests for the same thing join rather than fetching it again
+bool use_coalescing = true;
+struct flight *flights[FLIGHT_BUCKETS];
+struct flight *free_flights = NULL;
+unsigned long long int joined_flights = 0;
+
+// Prefetching of local links in gophermaps as they're served, so following one gets answered from the cache
+// Links wait in a queue of their own, and are fetched a few at a time once the clients' requests of the batch have been handled
+#define PREFETCH_QUEUE 256
+long int prefetch_links = 0; // Per gophermap, 0 disabling prefetching
+long int prefetch_concurrency = 4;
+long int prefetch_budget = 1 << 20; // In bytes per second
+struct prefetch_link {
+	char itemtype;
+	char *selector;
+	size_t selector_size;
+};
+struct {
+	struct prefetch_link queue[PREFETCH_QUEUE];
+	size_t head;
+	size_t fill;
+	size_t running;
+
+	// Bytes prefetches may still fetch, topped up as time goes by up to a second's worth
+	long long int budget;
+	long long int refilled;
+} prefetch;
+
+// Splicing for binary responses, and empty pipes kept around for it
+bool use_splice = true;
+struct pipe_pair pipe_pool[PIPE_POOL_SIZE];
+size_t number_pooled_pipes = 0;
+
+// Compression of text and gophermaps for clients that accept it, 0 disabling it, and encoders kept around for reuse
+// Bodies known to be smaller than the minimum size aren't worth it
+long int compression_level = 6;
+long int compression_min_size = 256;
+struct encoder *encoder_pool[ENCODER_POOL_SIZE];
+size_t number_pooled_encoders = 0;
 bool use_syslog = false;
 
+// Why a request failed, either with an error response or by the connection going away before the response was complete
+enum error_cause { BAD_REQUEST, REQUEST_TOO_LARGE, REQUEST_TIMEOUT, NOT_IMPLEMENTED, VERSION_NOT_SUPPORTED, NO_ADDRESSES, CONNECT_FAILED, CONNECT_TIMED_OUT, REMOTE_TIMED_OUT, FETCH_FAILED, ABORTED, NUMBER_ERROR_CAUSES };
+struct {
+	const char *status;
+	const char *name;
+} error_causes[NUMBER_ERROR_CAUSES] = {
+	{"400 Bad Request", "bad_request"},
+	{"431 Request Header Fields Too Large", "request_too_large"},
+	{"408 Request Timeout", "request_timeout"},
+	{"501 Not Implemented", "not_implemented"},
+	{"505 HTTP Version Not Supported", "version_not_supported"},
+	{"502 Bad Gateway", "no_addresses"},
+	{"502 Bad Gateway", "connect_failed"},
+	{"504 Gateway Timeout", "connect_timeout"},
+	{"504 Gateway Timeout", "remote_timeout"},
+	{"502 Bad Gateway", "fetch_failed"},
+	{NULL, "aborted"},
+};
+
+// Histogram of durations, with the bucket bounds in microseconds and a last bucket for anything longer
+#define HISTOGRAM_BUCKETS 14
+const long long int histogram_bounds[HISTOGRAM_BUCKETS - 1] = {1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};
+struct histogram {
+	unsigned long long int buckets[HISTOGRAM_BUCKETS];
+	unsigned long long int count;
+	unsigned long long int sum;
+};
+
+// Metrics of a worker, in memory shared with the other workers so that whichever of them gets a scrape can add them all up
+// Every worker only ever writes to its own, so updating them needs no locks
+struct metrics {
+	long long int connections[NUMBER_STATES];
+	unsigned long long int accepted;
+	unsigned long long int requests;
+	struct histogram connect_duration;
+	struct histogram first_byte_duration;
+	struct histogram request_duration;
+	unsigned long long int sent_bytes[256];
+	unsigned long long int errors[NUMBER_ERROR_CAUSES];
+	unsigned long long int access_log_dropped;
+	unsigned long long int timeouts[NUMBER_TIMEOUTS];
+
+	// Copied from the caches and flights once per batch of events
+	unsigned long long int cache_hits;
+	unsigned long long int cache_misses;
+	unsigned long long int cache_stores;
+	unsigned long long int cache_evictions;
+	unsigned long long int cache_objects;
+	unsigned long long int cache_bytes;
+	unsigned long long int disk_cache_hits;
+	unsigned long long int disk_cache_misses;
+	unsigned long long int disk_cache_stores;
+	unsigned long long int disk_cache_evictions;
+	unsigned long long int disk_cache_bytes;
+	unsigned long long int joined_flights;
+
+	// Prefetches started, stored in the cache, and requests answered by them, from the cache or by joining them
+	unsigned long long int prefetches;
+	unsigned long long int prefetch_stored;
+	unsigned long long int prefetch_hits;
+
+	// Per backend: requests in progress and passed on, connects and probes that failed, whether it's ejected, and how long connecting and the first byte took
+	long long int backend_connections[BACKENDS_MAX];
+	unsigned long long int backend_requests[BACKENDS_MAX];
+	unsigned long long int backend_failures[BACKENDS_MAX];
+	long long int backend_ejected[BACKENDS_MAX];
+	struct histogram backend_connect_duration[BACKENDS_MAX];
+	struct histogram backend_first_byte_duration[BACKENDS_MAX];
+};
+struct metrics *all_metrics = NULL;
+size_t number_metrics = 0;
+struct metrics *metrics = NULL;
+const char *metrics_path = NULL;
+
+// Access log: the event loop puts lines into a ring buffer, and a thread of its own writes them out in batches, so logging never waits on the disk
+// Only the event loop moves the tail and only the writer thread the head, so neither needs a lock; lines that don't fit are dropped and counted
+#define ACCESS_LOG_SIZE (1 << 20)
+#define ACCESS_LOG_LINE_MAX 1024
+#define ACCESS_LOG_INTERVAL 100 // In milliseconds
+const char *access_log_path = NULL;
+int access_log_fd = -1;
+char *access_log_ring = NULL;
+atomic_size_t access_log_head;
+atomic_size_t access_log_tail;
+int access_log_wakeup = -1;
+volatile sig_atomic_t reopen_requested = 0;
+
 void usage(FILE *stream) {
-	fprintf(stream, "%s [--daemon|-d] [--port|-p server_port] remote [remote_port]\n", program_name);
+	fprintf(stream, "%s [--daemon|-d] [--port|-p server_port] [--workers|-w number] [--engine epoll|poll] [--pool-size connections] [--max-connections number] [--backlog number] [--metrics path] [--access-log file] [--header-timeout seconds] [--connect-timeout milliseconds] [--remote-timeout seconds] [--client-timeout seconds] [--resolve-ttl seconds] [--buffer-size bytes] [--high-watermark bytes] [--low-watermark bytes] [--no-splice] [--no-coalesce] [--compression-level level] [--compression-min-size bytes] [--cache-size bytes] [--cache-max-object bytes] [--cache-ttl [itemtype:]seconds] [--disk-cache directory] [--disk-cache-size bytes] [--disk-cache-max-object bytes] [--backends file] [--balance least-connections|selector-hash] [--health-interval seconds] [--prefetch links] [--prefetch-concurrency number] [--prefetch-budget bytes] remote [remote_port] [remote [remote_port]]...\n", program_name);
 }
 
 void help(FILE *stream) {
@@ -111,6 +824,19 @@ long int parse_port(const char *string) {
 	}
 }
 
+long int parse_number(const char *string, long int min, long int max) {
+	char *endptr;
+	long int number = strtol(string, &endptr, 10);
+
+	if(endptr == string || *endptr != '\0') { // String did not fully scan as number
+		return -1;
+	} else if(number < min || number > max) { // Value out of range
+		return -1;
+	} else { // All ok
+		return number;
+	}
+}
+
 bool stringify_port(long int port, char *buffer, size_t buffer_length) {
 	int size = snprintf(buffer, buffer_length, "%li", port);
 
@@ -122,689 +848,5090 @@ bool stringify_port(long int port, char *buffer, size_t buffer_length) {
 	}
 }
 
-void add_socket(int sock, short events) {
-	// Grow the table of sockets
-	size_t index = number_sockets++;
-	sockets = realloc(sockets, number_sockets * sizeof(struct pollfd));
-
-	if(sockets == NULL) {
-		perror("realloc");
+long long int monotonic_ms(void) {
+	struct timespec now;
+	if(clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+		perror("clock_gettime");
 		exit(1);
 	}
-
-	// Add socket to the table
-	struct pollfd new_socket = {.fd = sock, .events = events};
-	sockets[index] = new_socket;
+	return (long long int)now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
 
-void remove_socket(size_t index) {
-	// Clean the socket up
-	close(sockets[index].fd);
-
-	if(index != number_sockets - 1) {
-		// The socket entry was not at the end of the table -> we need to rearrange to allow shrinking of allocation
-		memmove(&sockets[index], &sockets[number_sockets - 1], sizeof(*sockets));
-	}
-
-	// Now the last entry in the table is either the socket to remove or a duplicate -> safe to remove either way
-	// Shrink the allocation and update number_sockets
-	sockets = realloc(sockets, --number_sockets * sizeof(struct pollfd));
-
-	if(sockets == NULL && number_sockets != 0) {
-		perror("realloc");
+long long int monotonic_us(void) {
+	struct timespec now;
+	if(clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+		perror("clock_gettime");
 		exit(1);
 	}
+	return (long long int)now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
-size_t get_socket_index(int sock) {
-	for(size_t i = 0; i < number_sockets; i++) {
-		if(sockets[i].fd == sock) {
-			return i;
-		}
+void setup_metrics(size_t number) {
+	// Shared with the workers forked later on, one for each of them
+	number_metrics = number;
+	all_metrics = mmap(NULL, number * sizeof(struct metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(all_metrics == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
 	}
-
-	// None found, return index of last element + 1
-	return number_sockets;
 }
 
-void add_connection(int sock) {
-	// Grow the table of connections
-	size_t index = number_connections++;
-	connections = realloc(connections, number_connections * sizeof(struct connection));
+void use_metrics(size_t index) {
+	// Connections of a previous worker in this slot died with it, and so did the backends it had ejected
+	metrics = &all_metrics[index];
+	memset(metrics->connections, 0, sizeof(metrics->connections));
+	memset(metrics->backend_connections, 0, sizeof(metrics->backend_connections));
+	memset(metrics->backend_ejected, 0, sizeof(metrics->backend_ejected));
+}
 
-	if(connections == NULL) {
-		perror("realloc");
-		exit(1);
+void histogram_observe(struct histogram *histogram, long long int duration) {
+	size_t bucket = 0;
+	while(bucket < HISTOGRAM_BUCKETS - 1 && duration > histogram_bounds[bucket]) {
+		bucket++;
 	}
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->sum += duration;
+}
 
-	// Add socket to table of sockets
-	add_socket(sock, POLLIN);
-
-	// Initialise and add connection to the table
-	struct connection *connection = calloc(1, sizeof(struct connection));
-
-	if(connection == NULL && sizeof(struct connection) != 0) {
-		perror("calloc");
-		exit(1);
+void set_state(struct connection *conn, enum connection_state state) {
+	TRACE5(state, conn->id, conn->state, state, conn->path, conn->path_size);
+	if(!conn->prefetch) {
+		metrics->connections[conn->state]--;
+		metrics->connections[state]++;
 	}
+	conn->state = state;
+}
 
-	connection->state = START;
-	connection->sock = sock;
-	connection->sock_other = -1;
-
-	connections[index] = connection;
+bool would_block(void) {
+	return errno == EAGAIN || errno == EWOULDBLOCK;
 }
 
-void remove_connection(size_t index) {
-	// Clean the connection up
-	size_t socket_index = get_socket_index(connections[index]->sock);
-	if(socket_index == number_sockets) {
-		log_error("%s: socket to remove not in table of sockets\n", program_name);
+void set_nonblocking(int sock) {
+	int flags = fcntl(sock, F_GETFL);
+	if(flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+		perror("fcntl");
 		exit(1);
 	}
-	remove_socket(socket_index);
-
-	if(connections[index]->sock_other != -1) {
-		close(connections[index]->sock_other);
-	}
+}
 
-	if(connections[index]->path != NULL) {
-		free(connections[index]->path);
+void *memdup(const void *mem, size_t size) {
+	void *dup = malloc(size);
+	if(dup == NULL && size != 0) {
+		perror("malloc");
+		exit(1);
 	}
+	memmove(dup, mem, size);
+	return dup;
+}
 
-	if(connections[index]->buffer != NULL) {
-		free(connections[index]->buffer);
+void setup_engine(void) {
+	if(engine == EPOLL_ENGINE) {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if(epoll_fd == -1) {
+			perror("epoll_create1");
+			exit(1);
+		}
 	}
+}
 
-	if(index != number_connections - 1) {
-		// The connection was not at the end of the table -> we need to rearrange to allow shrinking of allocation
-		memmove(&connections[index], &connections[number_connections - 1], sizeof(*connections));
-	}
+void watch_socket(struct handle *handle) {
+	if(engine == EPOLL_ENGINE) {
+		// Connection sockets are registered edge-triggered for everything we might want from them
+		// The state machine itself keeps track of what it's waiting for, so changing that never needs a syscall
+		// Other sockets stay level-triggered, e.g. listening sockets, which may have connections left waiting when we stop accepting
+		struct epoll_event event = {.data.ptr = handle};
+		if(handle->conn == NULL && handle->type != PROBE_HANDLE) {
+			event.events = EPOLLIN;
+		} else {
+			event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		}
 
-	// Now the last entry in the table is either the connection to remove or a duplicate -> safe to remove either way
-	// Shrink the allocation and update number_connections
-	connections = realloc(connections, --number_connections * sizeof(struct connection));
+		if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handle->fd, &event) == -1) {
+			perror("epoll_ctl");
+			exit(1);
+		}
+	} else {
+		if(number_sockets == sockets_allocated) {
+			// Grow the table of sockets geometrically, so it only gets reallocated a logarithmic number of times
+			sockets_allocated = sockets_allocated == 0 ? 16 : 2 * sockets_allocated;
+			sockets = realloc(sockets, sockets_allocated * sizeof(*sockets));
+			socket_handles = realloc(socket_handles, sockets_allocated * sizeof(*socket_handles));
+
+			if(sockets == NULL || socket_handles == NULL) {
+				perror("realloc");
+				exit(1);
+			}
+		}
 
-	if(connections == NULL && number_connections != 0) {
-		perror("realloc");
-		exit(1);
+		// poll() ignores negative fds, which lets us park sockets we're not interested in without removing them from the table
+		size_t index = number_sockets++;
+		struct pollfd new_socket = {.fd = handle->events != 0 ? handle->fd : ~handle->fd, .events = handle->events};
+		sockets[index] = new_socket;
+		socket_handles[index] = handle;
+		handle->socket_index = index;
 	}
 }
 
-size_t get_connection_index(int sock) {
-	for(size_t i = 0; i < number_connections; i++) {
-		if(connections[i]->sock == sock) {
-			return i;
+void unwatch_socket(struct handle *handle) {
+	// With epoll closing the socket removes it from the epoll set, so there is nothing to do
+	if(engine == POLL_ENGINE) {
+		size_t index = handle->socket_index;
+
+		if(index != number_sockets - 1) {
+			// The socket entry was not at the end of the table -> move the last entry into its place
+			sockets[index] = sockets[number_sockets - 1];
+			socket_handles[index] = socket_handles[number_sockets - 1];
+			socket_handles[index]->socket_index = index;
 		}
-	}
 
-	// None found, return index of last element + 1
-	return number_connections;
+		number_sockets--;
+	}
 }
 
-void add_listen(struct addrinfo *res) {
-	const int yes = 1;
+void socket_interest(struct handle *handle, short events) {
+	handle->events = events;
 
-	// Create socket
-	int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-	if(sock == -1) {
-		perror("socket");
-		exit(1);
+	if(engine == POLL_ENGINE) {
+		sockets[handle->socket_index].fd = events != 0 ? handle->fd : ~handle->fd;
+		sockets[handle->socket_index].events = events;
 	}
+}
 
-	// Disable the IPv4 over IPv6, as that results in IPv4 and IPv6 sockets conflicting and one of them not being able to be set up
-	if(res->ai_family == AF_INET6) {
-		if(setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes)) == -1) {
-			perror("setsockopt");
-			exit(1);
-		}
+void timer_insert(struct timer *timer, long long int expires) {
+	// Timers already due go in the current slot, which is only still to be run while cascading into it
+	long long int delta = expires - wheel.tick;
+	if(delta < 0) {
+		delta = 0;
+		expires = wheel.tick;
 	}
 
-	// Set reuseaddr
-	if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
-		perror("setsockopt");
-		exit(1);
+	// Lowest level that reaches far enough, and the slot the expiry falls into on it
+	size_t level = 0;
+	while(level < WHEEL_LEVELS - 1 && delta >= 1LL << (WHEEL_BITS * (level + 1))) {
+		level++;
 	}
+	if(delta >= 1LL << (WHEEL_BITS * WHEEL_LEVELS)) {
+		expires = wheel.tick + (1LL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+	}
+	struct timer **slot = &wheel.slots[level][(expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
 
-	// Bind onto given address
-	if(bind(sock, res->ai_addr, res->ai_addrlen) == -1) {
-		perror("bind");
-		exit(1);
+	timer->expires = expires;
+	timer->next = *slot;
+	timer->pprev = slot;
+	if(*slot != NULL) {
+		(*slot)->pprev = &timer->next;
 	}
+	*slot = timer;
+}
 
-	// Listen for incoming connections
-	if(listen(sock, 1) == -1) {
-		perror("listen");
-		exit(1);
+void timer_remove(struct timer *timer) {
+	if(timer->pprev == NULL) {
+		return;
 	}
 
-	add_socket(sock, POLLIN);
+	*timer->pprev = timer->next;
+	if(timer->next != NULL) {
+		timer->next->pprev = timer->pprev;
+	}
+	timer->pprev = NULL;
+	timer->next = NULL;
+	wheel.armed--;
 }
 
-void setup_listen(unsigned long port) {
-	char port_string[6];
+void timer_add(struct timer *timer, long long int milliseconds) {
+	// Round up to whole ticks, and never into the slot being run right now
+	long long int expires = (monotonic_ms() + milliseconds + TIMER_TICK - 1) / TIMER_TICK;
+	if(expires <= wheel.tick) {
+		expires = wheel.tick + 1;
+	}
+	timer_insert(timer, expires);
+	wheel.armed++;
+}
 
-	// getaddrinfo wants port as a string, so stringify it
-	if(!stringify_port(port, port_string, sizeof(port_string))) {
-		log_error("%s: Could not convert %li to string\n", program_name, port);
-		exit(1);
+void set_timeout(struct connection *conn, enum timeout timeout) {
+	// Only one timeout applies at a time, so setting one replaces whichever was set before
+	timer_remove(&conn->timer);
+	conn->timeout = timeout;
+
+	long long int milliseconds;
+	switch(timeout) {
+		case HEADER_TIMEOUT: milliseconds = header_timeout * 1000LL; break;
+		case CONNECT_TIMEOUT: milliseconds = connect_timeout; break;
+		case REMOTE_TIMEOUT: milliseconds = remote_timeout * 1000LL; break;
+		case CLIENT_TIMEOUT: milliseconds = client_timeout * 1000LL; break;
+		default: return;
 	}
+	conn->timer.conn = conn;
+	timer_add(&conn->timer, milliseconds);
+}
 
-	struct addrinfo hints;
-	struct addrinfo *getaddrinfo_result;
+int timer_wait(void) {
+	// How long the event loop may wait before a timer is due, or before the next cascade could bring one down to the lowest level
+	if(wheel.armed == 0) {
+		return -1;
+	}
 
-	// AF_UNSPEC: either IPv4 or IPv6
-	// SOCK_STREAM: TCP
-	// AI_PASSIVE: fill out my IP for me
-	// AI_ADDRCONFIG: only return addresses I have a configured interface for
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
+	long long int tick = wheel.tick + 1;
+	while(wheel.slots[0][tick & (WHEEL_SLOTS - 1)] == NULL && (tick & (WHEEL_SLOTS - 1)) != 0) {
+		tick++;
+	}
 
-	int status = getaddrinfo(NULL, port_string, &hints, &getaddrinfo_result);
+	long long int left = tick * TIMER_TICK - monotonic_ms();
+	return left > 0 ? left : 0;
+}
 
-	if(status != 0) {
-		log_error("%s: getaddrinfo failed: %s\n", program_name, gai_strerror(status));
-		exit(1);
+void wait_on(struct connection *conn, struct handle *handle, short events) {
+	// Only ever wait on one of the connection's sockets at a time
+	struct handle *other = handle == &conn->client ? &conn->remote : &conn->client;
+	if(other->fd != -1 && other->events != 0) {
+		socket_interest(other, 0);
 	}
 
-	for(struct addrinfo *res = getaddrinfo_result; res != NULL; res = res->ai_next) {
-		// Add corresponding interface to table of sockets
-		add_listen(res);
+	if(handle->events != events) {
+		socket_interest(handle, events);
 	}
 
-	freeaddrinfo(getaddrinfo_result);
-
-	// Store the number of sockets corresponding to interfaces, as they won't be the only sockets in the table
-	number_interfaces = number_sockets;
+	// Waiting for the request and for connects is timed from when they start, the rest from when we last made progress
+	if(conn->state != START && conn->state != RESOLVING && conn->state != CONNECTING) {
+		set_timeout(conn, events == 0 ? NO_TIMEOUT : handle == &conn->remote ? REMOTE_TIMEOUT : CLIENT_TIMEOUT);
+	}
 }
 
-int connect_to_remote(void) {
-	struct addrinfo hints;
-	struct addrinfo *getaddrinfo_result;
-
-	// AF_UNSPEC: either IPv4 or IPv6
-	// SOCK_STREAM: TCP
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-
-	int status = getaddrinfo(remote, remote_port_string, &hints, &getaddrinfo_result);
+size_t wait_events(struct event *events, size_t max_events, int timeout) {
+	size_t amount_ready = 0;
 
-	if(status != 0) {
-		log_error("%s: getaddrinfo failed: %s\n", program_name, gai_strerror(status));
-		exit(1);
-	}
+	if(engine == EPOLL_ENGINE) {
+		struct epoll_event epoll_events[MAX_EVENTS];
+		if(max_events > MAX_EVENTS) {
+			max_events = MAX_EVENTS;
+		}
 
-	for(struct addrinfo *res = getaddrinfo_result; res != NULL; res = res->ai_next) {
-		// Create socket
-		int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-		if(sock == -1) {
-			perror("socket");
+		int amount = epoll_wait(epoll_fd, epoll_events, max_events, timeout);
+		if(amount < 0) {
+			if(errno == EINTR) {
+				return 0;
+			}
+			perror("epoll_wait");
 			exit(1);
 		}
 
-		// Connect to remote
-		if(connect(sock, res->ai_addr, res->ai_addrlen) == -1) {
-			close(sock);
-			continue;
+		for(int i = 0; i < amount; i++) {
+			events[i].handle = epoll_events[i].data.ptr;
+			events[i].revents = 0;
+			if(epoll_events[i].events & EPOLLIN) events[i].revents |= POLLIN;
+			if(epoll_events[i].events & EPOLLOUT) events[i].revents |= POLLOUT;
+			if(epoll_events[i].events & EPOLLHUP) events[i].revents |= POLLHUP;
+			if(epoll_events[i].events & EPOLLERR) events[i].revents |= POLLERR;
+		}
+		amount_ready = amount;
+	} else {
+		int amount = poll(sockets, number_sockets, timeout);
+		if(amount < 0) {
+			if(errno == EINTR) {
+				return 0;
+			}
+			perror("poll");
+			exit(1);
 		}
 
-		return sock;
+		// Copy the ready sockets out, as handling them rearranges the table of sockets
+		for(size_t i = 0; i < number_sockets && amount_ready < max_events && amount > 0; i++) {
+			if(sockets[i].revents != 0) {
+				events[amount_ready].handle = socket_handles[i];
+				events[amount_ready].revents = sockets[i].revents;
+				amount_ready++;
+				amount--;
+			}
+		}
 	}
 
-	return -1;
+	return amount_ready;
 }
 
-void buffer_append(char **buffer, size_t *buffer_length, char *appended, size_t appended_length) {
-	*buffer = realloc(*buffer, *buffer_length + appended_length);
-
-	if (*buffer == NULL && *buffer_length + appended_length != 0) {
-		perror("realloc");
+void grow_connection_pool(size_t amount) {
+	// One allocation for the connections and one for their ring buffers, with the memory of the ring buffers only touched once used
+	struct connection *slab = calloc(amount, sizeof(struct connection));
+	char *ring_memory = malloc(amount * ring_size);
+	if(slab == NULL || ring_memory == NULL) {
+		perror("malloc");
 		exit(1);
 	}
 
-	memmove(*buffer + *buffer_length, appended, appended_length);
-	*buffer_length = *buffer_length + appended_length;
+	for(size_t i = 0; i < amount; i++) {
+		slab[i].ring_memory = ring_memory + i * ring_size;
+		slab[i].next_free = free_connections;
+		free_connections = &slab[i];
+	}
+	pool_connections += amount;
 }
 
-void *memdup(const void *mem, size_t size) {
-	void *dup = malloc(size);
-	if(dup == NULL && size != 0) {
-		perror("malloc");
-		exit(1);
+void setup_connection_pool(void) {
+	while(pool_connections < (size_t)pool_size) {
+		grow_connection_pool(POOL_SLAB);
 	}
-	memmove(dup, mem, size);
-	return dup;
 }
 
-void switch_sockets(struct connection *conn) {
-	int tmp = conn->sock_other;
-	conn->sock_other = conn->sock;
-	conn->sock = tmp;
+struct connection *get_connection(void) {
+	if(free_connections == NULL) {
+		grow_connection_pool(POOL_SLAB);
+	}
+
+	// Start from a clean slate, except for the memory that stays with the slot
+	struct connection *connection = free_connections;
+	free_connections = connection->next_free;
+
+	char *ring_memory = connection->ring_memory;
+	struct gophermap *gophermap_memory = connection->gophermap_memory;
+	memset(connection, 0, sizeof(struct connection));
+	connection->ring_memory = ring_memory;
+	connection->gophermap_memory = gophermap_memory;
+
+	return connection;
 }
 
-void socket_change(int old, int new, short events) {
-	size_t socket_index = get_socket_index(old);
-	if(socket_index == number_sockets) {
-		log_error("%s: socket requested is not in list of sockets\n", program_name);
+void put_connection(struct connection *conn) {
+	conn->next_free = free_connections;
+	free_connections = conn;
+}
+
+void *arena_alloc(struct connection *conn, size_t size) {
+	// Everything allocated from the arena is small and bounded, so running out means a bug rather than an unusual request
+	if(size > ARENA_SIZE - conn->arena_used) {
+		log_error("%s: per-request arena exhausted\n", program_name);
 		exit(1);
 	}
-	sockets[socket_index].fd = new;
-	sockets[socket_index].events = events;
+	void *allocation = conn->arena + conn->arena_used;
+	conn->arena_used += size;
+	return allocation;
 }
 
-bool recognised_itemtype(char itemtype) {
-	return (
-		itemtype == '0' || // Text file
-		itemtype == '1' || // Gopher directory listing
-		itemtype == '4' || // BinHex archive
-		itemtype == '5' || // Binary archive
-		itemtype == '6' || // UUEncoded file
-		itemtype == '9' || // Binary file
-		itemtype == 'g' || // GIF image
-		itemtype == 'h' || // HTML document
-		itemtype == 'I' || // Image (generic)
-		itemtype == 's' // Sound
-	);
+char *arena_printf(struct connection *conn, size_t *size, const char *format, ...) {
+	// Format into whatever is left of the arena, and take only as much of it as the string needs
+	va_list args;
+	va_start(args, format);
+	size_t room = ARENA_SIZE - conn->arena_used;
+	int length = vsnprintf(conn->arena + conn->arena_used, room, format, args);
+	va_end(args);
+
+	if(length < 0) {
+		perror("vsnprintf");
+		exit(1);
+	}
+	*size = length;
+	return arena_alloc(conn, *size + 1);
 }
 
-void get_itemtype_selector(char *itemtype, char **selector, size_t *selector_length, const char *path, size_t path_length) {
-	const char *start = path;
-	size_t left = path_length;
+struct connection *new_connection(int sock) {
+	// Initialise a connection to the client on the socket, or -1 for none
+	struct connection *connection = get_connection();
+	connection->id = ++last_connection_id;
 
-	// Ignore a / on the beginning of path
-	if(left > 0 && start[0] == '/') {
-		start++;
-		left--;
+	connection->client.type = CLIENT_HANDLE;
+	connection->client.fd = sock;
+	connection->client.conn = connection;
+
+	connection->remote.type = REMOTE_HANDLE;
+	connection->remote.fd = -1;
+	connection->remote.conn = connection;
+
+	connection->pipe_pair.read_fd = -1;
+	connection->pipe_pair.write_fd = -1;
+	connection->capture_fd = -1;
+	connection->file_fd = -1;
+	return connection;
+}
+
+void add_connection(int sock, struct sockaddr *address, socklen_t address_size) {
+	struct connection *connection = new_connection(sock);
+	memcpy(&connection->client_address, address, address_size);
+	connection->client_address_size = address_size;
+
+	connection->state = START;
+	metrics->connections[START]++;
+	metrics->accepted++;
+	TRACE2(accept, connection->id, sock);
+
+	// Responses are written as they're ready, often ending with a small write such as the last chunk, which Nagle's algorithm would hold back until the client's delayed ACK
+	const int yes = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	connection->client.events = POLLIN;
+
+	// Add socket to the event engine
+	watch_socket(&connection->client);
+	set_timeout(connection, HEADER_TIMEOUT);
+}
+
+void resolving_push(struct connection *conn) {
+	conn->resolving_prev = resolving_tail;
+	conn->resolving_next = NULL;
+
+	if(resolving_tail != NULL) {
+		resolving_tail->resolving_next = conn;
+	} else {
+		resolving_head = conn;
 	}
+	resolving_tail = conn;
+	conn->resolving = true;
+}
 
-	// Special case: null-length selector has itemtype 1
-	// Otherwise, if we recognise the first character of path as itemtype -> save it as itemtype and move selector's beginning one forward
-	// If not, set itemtype to default itemtype and don't move beginning of selector
-	if(left == 0) {
-		*itemtype = '1';
-	} else if(left >= 1 && recognised_itemtype(start[0])) {
-		*itemtype = start[0];
-		start++;
-		left--;
+void resolving_remove(struct connection *conn) {
+	if(!conn->resolving) {
+		return;
+	}
+
+	if(conn->resolving_prev != NULL) {
+		conn->resolving_prev->resolving_next = conn->resolving_next;
 	} else {
-		*itemtype = default_itemtype;
+		resolving_head = conn->resolving_next;
+	}
+	if(conn->resolving_next != NULL) {
+		conn->resolving_next->resolving_prev = conn->resolving_prev;
+	} else {
+		resolving_tail = conn->resolving_prev;
 	}
+	conn->resolving = false;
+}
 
-	// Create a new buffer and copy selector to it
-	*selector = memdup(start, left);
-	*selector_length = left;
+void release_address_list(struct address_list *list) {
+	if(--list->references == 0) {
+		freeaddrinfo(list->addresses);
+		free(list);
+	}
 }
 
-const char *get_mimetype(char itemtype, const char *selector, size_t selector_length) {
-	// Special handling for itemtype 1
-	// Eventually, it will be translated into HTML, but for time being it'll be plain text
-	if(itemtype == '1') {
-		return "text/plain; charset=utf-8";
+void release_addresses(struct connection *conn) {
+	if(conn->addresses != NULL) {
+		release_address_list(conn->addresses);
+		conn->addresses = NULL;
 	}
+}
 
-	// Special handling for itemtypes I and s
-	if(itemtype == 'I' || itemtype == 's') {
-		char *extension = memrchr(selector, '.', selector_length);
-		ssize_t extension_legth = selector_length - (extension - selector);
-		if(extension == NULL) {
-			// There is no extension, everything is a lie
-			return default_mimetype;
-		}
+void backend_release(struct connection *conn) {
+	if(conn->backend != NULL) {
+		metrics->backend_connections[conn->backend - backends]--;
+		conn->backend = NULL;
+	}
+}
 
-		// Create a C string from the buffer + length
-		extension = strndup(extension, extension_legth);
-		if(extension == NULL) {
-			perror("strndup");
-			exit(1);
+void close_remote(struct connection *conn) {
+	resolving_remove(conn);
+
+	if(conn->remote.fd != -1) {
+		TRACE3(remote_close, conn->id, conn->state, conn->remote_eof);
+		unwatch_socket(&conn->remote);
+		close(conn->remote.fd);
+		conn->remote.fd = -1;
+		conn->remote.events = 0;
+	}
+}
+
+long int cache_ttl(char itemtype) {
+	long int ttl = cache_ttls[(unsigned char)itemtype];
+	return ttl >= 0 ? ttl : cache_default_ttl;
+}
+
+size_t cache_hash(char itemtype, const char *selector, size_t selector_size) {
+	// FNV-1a over the itemtype and selector
+	uint64_t hash = 14695981039346656037ULL;
+	hash = (hash ^ (unsigned char)itemtype) * 1099511628211ULL;
+	for(size_t i = 0; i < selector_size; i++) {
+		hash = (hash ^ (unsigned char)selector[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+size_t cache_entry_bytes(struct cache_entry *entry) {
+	size_t bytes = sizeof(*entry) + entry->selector_size + entry->body_size;
+	for(size_t encoding = 0; encoding < NUMBER_ENCODINGS; encoding++) {
+		bytes += entry->encoded_size[encoding];
+	}
+	return bytes;
+}
+
+void cache_free(struct cache_entry *entry) {
+	free(entry->selector);
+	free(entry->body);
+	for(size_t encoding = 0; encoding < NUMBER_ENCODINGS; encoding++) {
+		free(entry->encoded[encoding]);
+	}
+	free(entry);
+}
+
+void cache_release(struct cache_entry *entry) {
+	if(--entry->references == 0 && !entry->cached) {
+		cache_free(entry);
+	}
+}
+
+void cache_lru_unlink(struct cache_entry *entry) {
+	if(entry->lru_prev != NULL) {
+		entry->lru_prev->lru_next = entry->lru_next;
+	} else {
+		cache.lru_head = entry->lru_next;
+	}
+	if(entry->lru_next != NULL) {
+		entry->lru_next->lru_prev = entry->lru_prev;
+	} else {
+		cache.lru_tail = entry->lru_prev;
+	}
+}
+
+void cache_lru_push(struct cache_entry *entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = cache.lru_head;
+	if(cache.lru_head != NULL) {
+		cache.lru_head->lru_prev = entry;
+	} else {
+		cache.lru_tail = entry;
+	}
+	cache.lru_head = entry;
+}
+
+void cache_remove(struct cache_entry *entry) {
+	// Take the entry out of the hash table and LRU list, freeing it unless a connection is still serving it
+	struct cache_entry **link = &cache.buckets[cache_hash(entry->itemtype, entry->selector, entry->selector_size) % cache.number_buckets];
+	while(*link != entry) {
+		link = &(*link)->hash_next;
+	}
+	*link = entry->hash_next;
+	cache_lru_unlink(entry);
+
+	cache.number_entries--;
+	cache.bytes -= cache_entry_bytes(entry);
+	entry->cached = false;
+
+	if(entry->references == 0) {
+		cache_free(entry);
+	}
+}
+
+struct cache_entry *cache_find(char itemtype, const char *selector, size_t selector_size) {
+	if(cache.number_buckets == 0) {
+		return NULL;
+	}
+
+	struct cache_entry *entry = cache.buckets[cache_hash(itemtype, selector, selector_size) % cache.number_buckets];
+	while(entry != NULL && !(entry->itemtype == itemtype && entry->selector_size == selector_size && memcmp(entry->selector, selector, selector_size) == 0)) {
+		entry = entry->hash_next;
+	}
+	return entry;
+}
+
+struct cache_entry *cache_lookup(char itemtype, const char *selector, size_t selector_size) {
+	struct cache_entry *entry = cache_find(itemtype, selector, selector_size);
+
+	if(entry != NULL && entry->expires <= monotonic_ms()) {
+		cache_remove(entry);
+		entry = NULL;
+	}
+
+	if(entry == NULL) {
+		cache.misses++;
+		return NULL;
+	}
+
+	// Move to the front of the LRU list
+	cache_lru_unlink(entry);
+	cache_lru_push(entry);
+	cache.hits++;
+	return entry;
+}
+
+void cache_grow(void) {
+	// Rehash into twice the buckets, keeping chains short
+	size_t number_buckets = cache.number_buckets == 0 ? 1024 : 2 * cache.number_buckets;
+	struct cache_entry **buckets = calloc(number_buckets, sizeof(*buckets));
+	if(buckets == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for(size_t i = 0; i < cache.number_buckets; i++) {
+		struct cache_entry *entry = cache.buckets[i];
+		while(entry != NULL) {
+			struct cache_entry *next = entry->hash_next;
+			size_t bucket = cache_hash(entry->itemtype, entry->selector, entry->selector_size) % number_buckets;
+			entry->hash_next = buckets[bucket];
+			buckets[bucket] = entry;
+			entry = next;
 		}
+	}
 
-		for(size_t i = 0; i < sizeof(extension_mimetypes) / sizeof(*extension_mimetypes); i++) {
-			if(strcmp(extension, extension_mimetypes[i].ext) == 0) {
-				free(extension);
-				return extension_mimetypes[i].mimetype;
-			}
+	free(cache.buckets);
+	cache.buckets = buckets;
+	cache.number_buckets = number_buckets;
+}
+
+struct cache_entry *cache_store(char itemtype, const char *selector, size_t selector_size, char *body, size_t body_size, uint32_t checksum) {
+	// Takes ownership of body, returning the entry or NULL if it doesn't fit
+	struct cache_entry *entry = calloc(1, sizeof(struct cache_entry));
+	if(entry == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	entry->itemtype = itemtype;
+	entry->selector = memdup(selector, selector_size);
+	entry->selector_size = selector_size;
+	entry->body = body;
+	entry->body_size = body_size;
+	entry->expires = monotonic_ms() + cache_ttl(itemtype) * 1000;
+	entry->checksum = checksum;
+	entry->stored = time(NULL);
+
+	if(cache_entry_bytes(entry) > (size_t)cache_size) {
+		// Would never fit
+		cache_free(entry);
+		return NULL;
+	}
+
+	// Replace an older version, e.g. fetched by a concurrent request
+	struct cache_entry *old = cache_find(itemtype, selector, selector_size);
+	if(old != NULL) {
+		cache_remove(old);
+	}
+
+	// Evict least recently used entries until the new one fits in the budget
+	while(cache.bytes + cache_entry_bytes(entry) > (size_t)cache_size) {
+		cache_remove(cache.lru_tail);
+		cache.evictions++;
+	}
+
+	if(cache.number_entries >= cache.number_buckets) {
+		cache_grow();
+	}
+
+	size_t bucket = cache_hash(itemtype, selector, selector_size) % cache.number_buckets;
+	entry->hash_next = cache.buckets[bucket];
+	cache.buckets[bucket] = entry;
+	cache_lru_push(entry);
+	entry->cached = true;
+
+	cache.number_entries++;
+	cache.bytes += cache_entry_bytes(entry);
+	cache.stores++;
+	return entry;
+}
+
+int encoding_window_bits(enum content_encoding encoding) {
+	// Adding 16 to the window bits gets a gzip header and trailer around the deflate data, rather than a zlib one
+	return encoding == GZIP ? 15 + 16 : 15;
+}
+
+bool cache_encode(struct cache_entry *entry, enum content_encoding encoding) {
+	// Compress the body once for every hit that wants it that way, counting the copy against the budget
+	// Returns whether the entry has it, so the body can be sent that way
+	if(entry->encoded[encoding] != NULL) {
+		return true;
+	}
+
+	z_stream stream = {0};
+	if(deflateInit2(&stream, compression_level, Z_DEFLATED, encoding_window_bits(encoding), 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return false;
+	}
+	size_t bound = deflateBound(&stream, entry->body_size);
+	char *encoded = malloc(bound);
+	if(encoded == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	stream.next_in = (Bytef *)entry->body;
+	stream.avail_in = entry->body_size;
+	stream.next_out = (Bytef *)encoded;
+	stream.avail_out = bound;
+	int result = deflate(&stream, Z_FINISH);
+	deflateEnd(&stream);
+	if(result != Z_STREAM_END) {
+		free(encoded);
+		return false;
+	}
+
+	entry->encoded[encoding] = encoded;
+	entry->encoded_size[encoding] = bound - stream.avail_out;
+	if(entry->cached) {
+		// Make room for it, but not by evicting the entry itself
+		cache.bytes += entry->encoded_size[encoding];
+		while(cache.bytes > (size_t)cache_size && cache.lru_tail != entry) {
+			cache_remove(cache.lru_tail);
+			cache.evictions++;
 		}
+	}
+	return true;
+}
 
-		// Unrecognised extension
-		free(extension);
-		return default_mimetype;
+char *disk_cache_path(const char *name, uint64_t file_id) {
+	char *path;
+	if(asprintf(&path, "%s/%s%016llx", disk_cache_dir, name, (unsigned long long int)file_id) < 0) {
+		perror("asprintf");
+		exit(1);
 	}
+	return path;
+}
 
-	for(size_t i = 0; i < sizeof(mimetypes) / sizeof(*mimetypes); i++) {
-		if(itemtype == mimetypes[i].itemtype) {
-			return mimetypes[i].mimetype;
+size_t disk_cache_home(uint64_t hash) {
+	return hash % DISK_CACHE_SLOTS;
+}
+
+struct disk_cache_slot *disk_cache_find(char itemtype, const char *selector, size_t selector_size) {
+	if(disk_cache.index == NULL || selector_size > DISK_CACHE_SELECTOR_MAX) {
+		return NULL;
+	}
+
+	uint64_t hash = cache_hash(itemtype, selector, selector_size);
+	for(size_t i = disk_cache_home(hash), probes = 0; probes < DISK_CACHE_SLOTS; i = (i + 1) % DISK_CACHE_SLOTS, probes++) {
+		struct disk_cache_slot *slot = &disk_cache.index->slots[i];
+		if(!slot->used) {
+			return NULL;
+		}
+		if(slot->hash == hash && slot->itemtype == itemtype && slot->selector_size == selector_size && memcmp(slot->selector, selector, selector_size) == 0) {
+			return slot;
 		}
 	}
+	return NULL;
+}
 
-	// Nothing matched
-	return default_mimetype;
+void disk_cache_lru_unlink(uint32_t i) {
+	struct disk_cache_index *index = disk_cache.index;
+	struct disk_cache_slot *slot = &index->slots[i];
+	if(slot->lru_prev != DISK_CACHE_NO_SLOT) {
+		index->slots[slot->lru_prev].lru_next = slot->lru_next;
+	} else {
+		index->lru_head = slot->lru_next;
+	}
+	if(slot->lru_next != DISK_CACHE_NO_SLOT) {
+		index->slots[slot->lru_next].lru_prev = slot->lru_prev;
+	} else {
+		index->lru_tail = slot->lru_prev;
+	}
 }
 
+void disk_cache_lru_push(uint32_t i) {
+	struct disk_cache_index *index = disk_cache.index;
+	struct disk_cache_slot *slot = &index->slots[i];
+	slot->lru_prev = DISK_CACHE_NO_SLOT;
+	slot->lru_next = index->lru_head;
+	if(index->lru_head != DISK_CACHE_NO_SLOT) {
+		index->slots[index->lru_head].lru_prev = i;
+	} else {
+		index->lru_tail = i;
+	}
+	index->lru_head = i;
+}
 
-enum copymode get_copymode(char itemtype) {
-	if(itemtype == '1') { // Gopher directory listing
-		return GOPHERMAP;
-	} else if(itemtype == '0' || itemtype == '4' || itemtype == '6' || itemtype == 'h') { // Text file, UUEncoded file, HTML document
-		return TEXT;
+void disk_cache_lru_moved(uint32_t i) {
+	// The slot has just been moved to index i, so point its neighbours at its new place
+	struct disk_cache_index *index = disk_cache.index;
+	struct disk_cache_slot *slot = &index->slots[i];
+	if(slot->lru_prev != DISK_CACHE_NO_SLOT) {
+		index->slots[slot->lru_prev].lru_next = i;
 	} else {
-		return BINARY;
+		index->lru_head = i;
+	}
+	if(slot->lru_next != DISK_CACHE_NO_SLOT) {
+		index->slots[slot->lru_next].lru_prev = i;
+	} else {
+		index->lru_tail = i;
+	}
+}
+
+void disk_cache_remove(struct disk_cache_slot *slot) {
+	char *path = disk_cache_path("", slot->file_id);
+	unlink(path);
+	free(path);
+
+	struct disk_cache_index *index = disk_cache.index;
+	struct disk_cache_slot *slots = index->slots;
+	size_t hole = slot - slots;
+	disk_cache_lru_unlink(hole);
+	index->bytes -= slot->size;
+	index->used_slots--;
+
+	// Shift following slots back into the hole, so lookups never need to skip over deleted slots
+	// In an index that was full the run of slots goes all the way round, so stop after one lap
+	for(size_t i = (hole + 1) % DISK_CACHE_SLOTS, probes = 1; probes < DISK_CACHE_SLOTS && slots[i].used; i = (i + 1) % DISK_CACHE_SLOTS, probes++) {
+		size_t home = disk_cache_home(slots[i].hash);
+		// Can the slot move back to the hole without ending up before its home?
+		bool movable = hole <= i ? (home <= hole || home > i) : (home <= hole && home > i);
+		if(movable) {
+			slots[hole] = slots[i];
+			disk_cache_lru_moved(hole);
+			hole = i;
+		}
+	}
+	memset(&slots[hole], 0, sizeof(slots[hole]));
+}
+
+int disk_cache_open(char itemtype, const char *selector, size_t selector_size, off_t *size, uint32_t *checksum, time_t *stored) {
+	// Returns an fd of the cached object along with its size and validators, or -1 if it isn't cached
+	struct disk_cache_slot *slot = disk_cache_find(itemtype, selector, selector_size);
+	if(slot == NULL) {
+		disk_cache.misses++;
+		return -1;
+	}
+
+	if(slot->expires <= time(NULL)) {
+		disk_cache_remove(slot);
+		disk_cache.misses++;
+		return -1;
+	}
+
+	char *path = disk_cache_path("", slot->file_id);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+
+	// A missing or truncated object, e.g. after a crash, is as good as not cached
+	struct stat status;
+	if(fd == -1 || fstat(fd, &status) == -1 || (uint64_t)status.st_size != slot->size) {
+		if(fd != -1) {
+			close(fd);
+		}
+		disk_cache_remove(slot);
+		disk_cache.misses++;
+		return -1;
+	}
+
+	slot->last_used = time(NULL);
+	disk_cache_lru_unlink(slot - disk_cache.index->slots);
+	disk_cache_lru_push(slot - disk_cache.index->slots);
+	*size = status.st_size;
+	*checksum = slot->checksum;
+	*stored = slot->stored;
+	disk_cache.hits++;
+	return fd;
+}
+
+void disk_cache_store(char itemtype, const char *selector, size_t selector_size, const char *temporary_path, size_t size, uint32_t checksum) {
+	if(size > (size_t)disk_cache_size) {
+		unlink(temporary_path);
+		return;
+	}
+
+	// Replace an older version, e.g. fetched by a concurrent request
+	struct disk_cache_slot *old = disk_cache_find(itemtype, selector, selector_size);
+	if(old != NULL) {
+		disk_cache_remove(old);
+	}
+
+	// Evict least recently used objects until the new one fits in the budget, and there's a slot to spare for it
+	struct disk_cache_index *index = disk_cache.index;
+	while((index->bytes + size > (size_t)disk_cache_size || index->used_slots >= DISK_CACHE_MAX_USED) && index->used_slots > 0) {
+		disk_cache_remove(&index->slots[index->lru_tail]);
+		disk_cache.evictions++;
+	}
+
+	uint64_t hash = cache_hash(itemtype, selector, selector_size);
+	size_t i = disk_cache_home(hash);
+	while(disk_cache.index->slots[i].used) {
+		i = (i + 1) % DISK_CACHE_SLOTS;
+	}
+
+	// Move the object into place before it shows up in the index
+	uint64_t file_id = disk_cache.index->next_file_id++;
+	char *path = disk_cache_path("", file_id);
+	if(rename(temporary_path, path) == -1) {
+		perror("rename");
+		unlink(temporary_path);
+		free(path);
+		return;
+	}
+	free(path);
+
+	struct disk_cache_slot *slot = &disk_cache.index->slots[i];
+	slot->hash = hash;
+	slot->file_id = file_id;
+	slot->size = size;
+	slot->expires = time(NULL) + cache_ttl(itemtype);
+	slot->last_used = time(NULL);
+	slot->stored = time(NULL);
+	slot->itemtype = itemtype;
+	slot->selector_size = selector_size;
+	slot->checksum = checksum;
+	memmove(slot->selector, selector, selector_size);
+	slot->used = 1;
+	disk_cache_lru_push(i);
+
+	index->used_slots++;
+	index->bytes += size;
+	disk_cache.stores++;
+}
+
+int compare_last_used(const void *a, const void *b) {
+	// Least recently used slot first
+	int64_t a_used = disk_cache.index->slots[*(const uint32_t *)a].last_used;
+	int64_t b_used = disk_cache.index->slots[*(const uint32_t *)b].last_used;
+	return (a_used > b_used) - (a_used < b_used);
+}
+
+void setup_disk_cache(void) {
+	if(disk_cache_root == NULL) {
+		return;
+	}
+
+	// Every worker gets a directory of its own, so they never step on each other's toes
+	if(asprintf(&disk_cache_dir, "%s/%li", disk_cache_root, worker_index) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	if(mkdir(disk_cache_root, 0700) == -1 && errno != EEXIST) {
+		perror("mkdir");
+		exit(1);
+	}
+	if(mkdir(disk_cache_dir, 0700) == -1 && errno != EEXIST) {
+		perror("mkdir");
+		exit(1);
+	}
+
+	// Temporary files left over from a previous run are incomplete objects
+	DIR *dir = opendir(disk_cache_dir);
+	if(dir == NULL) {
+		perror("opendir");
+		exit(1);
+	}
+	struct dirent *dirent;
+	while((dirent = readdir(dir)) != NULL) {
+		if(strncmp(dirent->d_name, "tmp", 3) == 0) {
+			unlinkat(dirfd(dir), dirent->d_name, 0);
+		}
+	}
+	closedir(dir);
+
+	// Map the index, setting it up from scratch if it's missing or doesn't match our layout
+	char *path;
+	if(asprintf(&path, "%s/index", disk_cache_dir) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(fd == -1) {
+		perror("open");
+		exit(1);
+	}
+	free(path);
+
+	struct stat status;
+	if(fstat(fd, &status) == -1) {
+		perror("fstat");
+		exit(1);
+	}
+	if((size_t)status.st_size != sizeof(struct disk_cache_index)) {
+		// Zero it out, which makes the magic number mismatch below
+		if(ftruncate(fd, 0) == -1 || ftruncate(fd, sizeof(struct disk_cache_index)) == -1) {
+			perror("ftruncate");
+			exit(1);
+		}
+	}
+
+	disk_cache.index = mmap(NULL, sizeof(struct disk_cache_index), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(disk_cache.index == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
+
+	struct disk_cache_index *index = disk_cache.index;
+	if(index->magic != DISK_CACHE_MAGIC || index->slot_size != sizeof(struct disk_cache_slot) || index->number_slots != DISK_CACHE_SLOTS) {
+		memset(index, 0, sizeof(*index));
+		index->magic = DISK_CACHE_MAGIC;
+		index->slot_size = sizeof(struct disk_cache_slot);
+		index->number_slots = DISK_CACHE_SLOTS;
+	}
+
+	// Warm start: pick up where the previous run left off
+	// The counts and the LRU list are made again from the slots, in case the previous run died halfway through updating them
+	uint32_t *order = malloc(DISK_CACHE_SLOTS * sizeof(*order));
+	if(order == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	size_t used = 0;
+	index->bytes = 0;
+	for(uint32_t i = 0; i < DISK_CACHE_SLOTS; i++) {
+		if(index->slots[i].used) {
+			order[used++] = i;
+			index->bytes += index->slots[i].size;
+		}
+	}
+	qsort(order, used, sizeof(*order), compare_last_used);
+	index->used_slots = used;
+	index->lru_head = DISK_CACHE_NO_SLOT;
+	index->lru_tail = DISK_CACHE_NO_SLOT;
+	for(size_t i = 0; i < used; i++) {
+		disk_cache_lru_push(order[i]);
+	}
+	free(order);
+
+	// An index filled further by an older version is brought back down to the limit
+	while(index->used_slots > DISK_CACHE_MAX_USED) {
+		disk_cache_remove(&index->slots[index->lru_tail]);
+	}
+}
+
+void wake_connection(struct connection *conn) {
+	// Have the event loop handle the connection after the current batch of events, as if it had an event of its own
+	if(conn->woken || conn->closed) {
+		return;
+	}
+	conn->woken = true;
+	conn->next_woken = woken_connections;
+	woken_connections = conn;
+}
+
+struct flight *flight_find(char itemtype, const char *selector, size_t selector_size) {
+	size_t bucket = cache_hash(itemtype, selector, selector_size) % FLIGHT_BUCKETS;
+	for(struct flight *flight = flights[bucket]; flight != NULL; flight = flight->hash_next) {
+		if(flight->itemtype == itemtype && flight->selector_size == selector_size && memcmp(flight->selector, selector, selector_size) == 0) {
+			return flight;
+		}
+	}
+	return NULL;
+}
+
+void flight_unhash(struct flight *flight) {
+	if(!flight->hashed) {
+		return;
+	}
+
+	size_t bucket = cache_hash(flight->itemtype, flight->selector, flight->selector_size) % FLIGHT_BUCKETS;
+	struct flight **link = &flights[bucket];
+	while(*link != flight) {
+		link = &(*link)->hash_next;
+	}
+	*link = flight->hash_next;
+	flight->hashed = false;
+}
+
+void flight_lead(struct connection *conn) {
+	// Start a fetch others can join, in a flight from the pool if there's one, which keeps its room for a selector
+	struct flight *flight = free_flights;
+	if(flight != NULL) {
+		free_flights = flight->next_free;
+		char *selector = flight->selector;
+		size_t selector_allocated = flight->selector_allocated;
+		memset(flight, 0, sizeof(struct flight));
+		flight->selector = selector;
+		flight->selector_allocated = selector_allocated;
+	} else {
+		flight = calloc(1, sizeof(struct flight));
+		if(flight == NULL) {
+			perror("calloc");
+			exit(1);
+		}
+	}
+
+	if(flight->selector == NULL || conn->path_size > flight->selector_allocated) {
+		size_t allocated = flight->selector_allocated == 0 ? 64 : flight->selector_allocated;
+		while(allocated < conn->path_size) {
+			allocated *= 2;
+		}
+		flight->selector = realloc(flight->selector, allocated);
+		if(flight->selector == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		flight->selector_allocated = allocated;
+	}
+	memcpy(flight->selector, conn->path, conn->path_size);
+	flight->itemtype = conn->itemtype;
+	flight->selector_size = conn->path_size;
+	flight->joinable = true;
+	flight->leader = conn;
+	flight->references = 1;
+
+	size_t bucket = cache_hash(flight->itemtype, flight->selector, flight->selector_size) % FLIGHT_BUCKETS;
+	flight->hash_next = flights[bucket];
+	flights[bucket] = flight;
+	flight->hashed = true;
+
+	conn->flight = flight;
+}
+
+void flight_keep(struct flight *flight, const char *data, size_t size) {
+	if(flight->data_size + size > flight->data_allocated) {
+		size_t allocated = flight->data_allocated == 0 ? 4096 : flight->data_allocated;
+		while(allocated < flight->data_size + size) {
+			allocated *= 2;
+		}
+		flight->data = realloc(flight->data, allocated);
+		if(flight->data == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		flight->data_allocated = allocated;
+	}
+	memcpy(flight->data + flight->data_size, data, size);
+	flight->data_size += size;
+}
+
+bool flight_joinable(struct flight *flight) {
+	if(flight->buffered) {
+		return flight->joinable;
+	}
+
+	// Until someone joins, that's for as long as the leader hasn't had any of the body yet or has all of it in memory for the cache
+	struct connection *leader = flight->leader;
+	return leader != NULL && (leader->state < STREAM || (leader->state == STREAM && !leader->first_byte) || (leader->capturing && leader->capture_fd == -1));
+}
+
+void flight_follow(struct connection *conn, struct flight *flight) {
+	if(!flight->buffered) {
+		// The first request to join starts the keeping of the body, from what the leader has sent so far
+		flight->buffered = true;
+		if(flight->leader->capturing && flight->leader->capture_size > 0) {
+			flight_keep(flight, flight->leader->capture, flight->leader->capture_size);
+		}
+	}
+
+	flight->references++;
+	conn->flight = flight;
+	conn->flight_offset = 0;
+	conn->follower_prev = NULL;
+	conn->follower_next = flight->followers;
+	if(flight->followers != NULL) {
+		flight->followers->follower_prev = conn;
+	}
+	flight->followers = conn;
+	joined_flights++;
+}
+
+void flight_wake_followers(struct flight *flight) {
+	// Followers that have caught up wait to be told there's more
+	for(struct connection *follower = flight->followers; follower != NULL; follower = follower->follower_next) {
+		if(follower->flight_waiting) {
+			follower->flight_waiting = false;
+			wake_connection(follower);
+		}
+	}
+}
+
+bool flight_tapped(struct connection *conn) {
+	// Whether what the connection sends its client has to be kept for others
+	return conn->flight != NULL && conn->flight->leader == conn && conn->flight->buffered && (conn->flight->joinable || conn->flight->followers != NULL);
+}
+
+void flight_trim(struct flight *flight) {
+	// Once nobody can join anymore, drop what every follower has sent
+	if(flight->joinable) {
+		return;
+	}
+
+	size_t lowest = flight->base + flight->data_size;
+	for(struct connection *follower = flight->followers; follower != NULL; follower = follower->follower_next) {
+		if(follower->flight_offset < lowest) {
+			lowest = follower->flight_offset;
+		}
+	}
+
+	// Only bother moving the rest once it's no larger than what's dropped
+	size_t dropped = lowest - flight->base;
+	if(dropped == 0 || dropped * 2 < flight->data_size) {
+		return;
+	}
+	flight->data_size -= dropped;
+	memmove(flight->data, flight->data + dropped, flight->data_size);
+	flight->base = lowest;
+
+	// The leader may have been waiting for the followers to catch up
+	if(flight->leader != NULL && flight->data_size <= (size_t)low_watermark) {
+		wake_connection(flight->leader);
+	}
+}
+
+void flight_append(struct flight *flight, const char *data, size_t size) {
+	if(flight->joinable && flight->data_size + size > (size_t)cache_max_object) {
+		// Too large to keep all of it for requests that might still join, so only keep what the followers still need
+		flight->joinable = false;
+		flight_unhash(flight);
+		flight_trim(flight);
+	}
+	if(!flight->joinable && flight->followers == NULL) {
+		return;
+	}
+
+	flight_keep(flight, data, size);
+	flight_wake_followers(flight);
+}
+
+size_t flight_backlog(struct connection *conn) {
+	// How much the followers of the connection's fetch are behind, once that isn't kept for joining anymore
+	if(conn->flight == NULL || conn->flight->leader != conn || conn->flight->joinable) {
+		return 0;
+	}
+	return conn->flight->data_size;
+}
+
+void flight_complete(struct connection *conn) {
+	// The leader has the whole body, new requests can get it from the cache or fetch it again
+	if(conn->flight == NULL || conn->flight->leader != conn) {
+		return;
+	}
+	conn->flight->complete = true;
+	flight_unhash(conn->flight);
+	flight_wake_followers(conn->flight);
+}
+
+void flight_release(struct connection *conn) {
+	struct flight *flight = conn->flight;
+	if(flight == NULL) {
+		return;
+	}
+	conn->flight = NULL;
+	conn->flight_waiting = false;
+
+	if(flight->leader == conn) {
+		// Followers can't get the rest of the body anymore if it wasn't complete
+		flight->leader = NULL;
+		if(!flight->complete) {
+			flight->failed = true;
+		}
+		flight_unhash(flight);
+		flight_wake_followers(flight);
+	} else {
+		if(conn->follower_prev != NULL) {
+			conn->follower_prev->follower_next = conn->follower_next;
+		} else {
+			flight->followers = conn->follower_next;
+		}
+		if(conn->follower_next != NULL) {
+			conn->follower_next->follower_prev = conn->follower_prev;
+		}
+		flight_trim(flight);
+	}
+
+	if(--flight->references == 0) {
+		// Only the body is let go of, as it can be large and is only there when a request joined
+		free(flight->data);
+		flight->data = NULL;
+		flight->next_free = free_flights;
+		free_flights = flight;
+	}
+}
+
+bool prefetch_wanted(char itemtype, const char *selector, size_t selector_size) {
+	// Whether prefetching the item is worth it: it gets cached, and isn't already, nor is it being fetched
+	if(cache_ttl(itemtype) <= 0 || selector_size > REQUEST_MAX) {
+		return false;
+	}
+	struct cache_entry *entry = cache_find(itemtype, selector, selector_size);
+	if(entry != NULL && entry->expires > monotonic_ms()) {
+		return false;
+	}
+	return flight_find(itemtype, selector, selector_size) == NULL && disk_cache_find(itemtype, selector, selector_size) == NULL;
+}
+
+void prefetch_queue(struct gophermap *map, char itemtype, const char *selector, size_t selector_size) {
+	// Queue one of the first links of the gophermap, pushing out the oldest link queued if there's no room
+	if(map->prefetched >= prefetch_links) {
+		return;
+	}
+	map->prefetched++;
+	if(!prefetch_wanted(itemtype, selector, selector_size)) {
+		return;
+	}
+	for(size_t i = 0; i < prefetch.fill; i++) {
+		struct prefetch_link *link = &prefetch.queue[(prefetch.head + i) % PREFETCH_QUEUE];
+		if(link->itemtype == itemtype && link->selector_size == selector_size && memcmp(link->selector, selector, selector_size) == 0) {
+			return;
+		}
+	}
+
+	if(prefetch.fill == PREFETCH_QUEUE) {
+		free(prefetch.queue[prefetch.head].selector);
+		prefetch.head = (prefetch.head + 1) % PREFETCH_QUEUE;
+		prefetch.fill--;
+	}
+	struct prefetch_link *link = &prefetch.queue[(prefetch.head + prefetch.fill) % PREFETCH_QUEUE];
+	link->itemtype = itemtype;
+	link->selector = memdup(selector, selector_size);
+	link->selector_size = selector_size;
+	prefetch.fill++;
+}
+
+size_t memory_capture_limit(void) {
+	return cache_size > 0 ? (size_t)cache_max_object : 0;
+}
+
+void stop_capture(struct connection *conn) {
+	free(conn->capture);
+	conn->capture = NULL;
+	conn->capture_size = 0;
+	conn->capture_allocated = 0;
+
+	if(conn->capture_fd != -1) {
+		close(conn->capture_fd);
+		unlink(conn->capture_path);
+		conn->capture_fd = -1;
+	}
+
+	conn->capturing = false;
+}
+
+bool write_all(int fd, const char *data, size_t size) {
+	while(size > 0) {
+		ssize_t amount = write(fd, data, size);
+		if(amount == -1) {
+			return false;
+		}
+		data += amount;
+		size -= amount;
+	}
+	return true;
+}
+
+void capture(struct connection *conn, const char *data, size_t size) {
+	if(flight_tapped(conn)) {
+		flight_append(conn->flight, data, size);
+	}
+
+	if(!conn->capturing) {
+		return;
+	}
+
+	// The checksum is worked out on the way, and becomes the ETag of the cached body
+	conn->capture_checksum = crc32(conn->capture_checksum, (const Bytef *)data, size);
+
+	if(conn->capture_fd == -1 && conn->capture_size + size > memory_capture_limit()) {
+		// Too large for the memory cache, spill into a temporary file for the disk cache if possible
+		if(disk_cache.index == NULL || conn->path_size > DISK_CACHE_SELECTOR_MAX) {
+			stop_capture(conn);
+			return;
+		}
+
+		conn->capture_path = disk_cache_path("tmp", disk_cache.temporary_files++);
+		conn->capture_fd = open(conn->capture_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if(conn->capture_fd == -1) {
+			perror("open");
+			stop_capture(conn);
+			return;
+		}
+
+		if(!write_all(conn->capture_fd, conn->capture, conn->capture_size)) {
+			stop_capture(conn);
+			return;
+		}
+		free(conn->capture);
+		conn->capture = NULL;
+		conn->capture_allocated = 0;
+	}
+
+	if(conn->capture_fd != -1) {
+		if(conn->capture_size + size > (size_t)disk_cache_max_object || !write_all(conn->capture_fd, data, size)) {
+			stop_capture(conn);
+			return;
+		}
+		conn->capture_size += size;
+		return;
+	}
+
+	if(conn->capture_size + size > conn->capture_allocated) {
+		size_t allocated = conn->capture_allocated == 0 ? 4096 : conn->capture_allocated;
+		while(allocated < conn->capture_size + size) {
+			allocated *= 2;
+		}
+		conn->capture = realloc(conn->capture, allocated);
+		if(conn->capture == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		conn->capture_allocated = allocated;
+	}
+
+	memmove(conn->capture + conn->capture_size, data, size);
+	conn->capture_size += size;
+}
+
+void finish_capture(struct connection *conn) {
+	// The body is complete, store it in whichever cache it's meant for
+	if(conn->capture_fd != -1) {
+		close(conn->capture_fd);
+		conn->capture_fd = -1;
+		disk_cache_store(conn->itemtype, conn->path, conn->path_size, conn->capture_path, conn->capture_size, conn->capture_checksum);
+		if(conn->prefetch) {
+			metrics->prefetch_stored++;
+		}
+	} else {
+		struct cache_entry *entry = cache_store(conn->itemtype, conn->path, conn->path_size, conn->capture, conn->capture_size, conn->capture_checksum);
+		conn->capture = NULL;
+		if(entry != NULL && conn->prefetch) {
+			entry->prefetched = true;
+			metrics->prefetch_stored++;
+		}
+	}
+
+	conn->capturing = false;
+}
+
+void log_stats(void) {
+	if(cache_size > 0) {
+		log_error("%s[%li]: cache: %llu hits, %llu misses, %llu stores, %llu evictions, %zu objects, %zu bytes\n", program_name, (long int)getpid(), cache.hits, cache.misses, cache.stores, cache.evictions, cache.number_entries, cache.bytes);
+	}
+	if(disk_cache.index != NULL) {
+		log_error("%s[%li]: disk cache: %llu hits, %llu misses, %llu stores, %llu evictions, %zu bytes\n", program_name, (long int)getpid(), disk_cache.hits, disk_cache.misses, disk_cache.stores, disk_cache.evictions, (size_t)disk_cache.index->bytes);
+	}
+	if(use_coalescing) {
+		log_error("%s[%li]: %llu requests joined a fetch in progress\n", program_name, (long int)getpid(), joined_flights);
+	}
+}
+
+bool get_pipe(struct pipe_pair *pipe_pair) {
+	if(number_pooled_pipes > 0) {
+		*pipe_pair = pipe_pool[--number_pooled_pipes];
+		return true;
+	}
+
+	int fds[2];
+	if(pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+		return false;
+	}
+	pipe_pair->read_fd = fds[0];
+	pipe_pair->write_fd = fds[1];
+
+	// Make the pipe as large as the ring buffer would have been, if the kernel lets us
+	fcntl(fds[1], F_SETPIPE_SZ, ring_size);
+	int size = fcntl(fds[1], F_GETPIPE_SZ);
+	pipe_pair->size = size > 0 ? size : 65536;
+
+	return true;
+}
+
+void put_pipe(struct pipe_pair *pipe_pair, bool empty) {
+	// Pipes with data left in them can't be reused
+	if(empty && number_pooled_pipes < PIPE_POOL_SIZE) {
+		pipe_pool[number_pooled_pipes++] = *pipe_pair;
+	} else {
+		close(pipe_pair->read_fd);
+		close(pipe_pair->write_fd);
+	}
+
+	pipe_pair->read_fd = -1;
+	pipe_pair->write_fd = -1;
+}
+
+struct encoder *get_encoder(enum content_encoding encoding) {
+	// Pooled encoders only need resetting, unless they were set up for the other format
+	struct encoder *encoder = number_pooled_encoders > 0 ? encoder_pool[--number_pooled_encoders] : NULL;
+	if(encoder != NULL && encoder->encoding == encoding) {
+		deflateReset(&encoder->stream);
+	} else {
+		if(encoder != NULL) {
+			deflateEnd(&encoder->stream);
+		} else {
+			encoder = malloc(sizeof(struct encoder));
+			if(encoder == NULL) {
+				perror("malloc");
+				exit(1);
+			}
+		}
+
+		memset(&encoder->stream, 0, sizeof(encoder->stream));
+		if(deflateInit2(&encoder->stream, compression_level, Z_DEFLATED, encoding_window_bits(encoding), 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			log_error("%s: deflateInit2 failed\n", program_name);
+			exit(1);
+		}
+		encoder->encoding = encoding;
+	}
+
+	encoder->unflushed = false;
+	encoder->finished = false;
+	encoder->out_size = 0;
+	encoder->out_written = 0;
+	return encoder;
+}
+
+void put_encoder(struct encoder *encoder) {
+	if(number_pooled_encoders < ENCODER_POOL_SIZE) {
+		encoder_pool[number_pooled_encoders++] = encoder;
+	} else {
+		deflateEnd(&encoder->stream);
+		free(encoder);
+	}
+}
+
+void open_access_log(void) {
+	int fd = open(access_log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if(fd == -1) {
+		if(access_log_fd == -1) {
+			perror("open");
+			exit(1);
+		}
+		// Reopening, after privileges have been dropped, so keep writing to the old file rather than give up
+		log_error("%s: Could not reopen access log %s: %s\n", program_name, access_log_path, strerror(errno));
+		return;
+	}
+
+	if(access_log_fd != -1) {
+		close(access_log_fd);
+	}
+	access_log_fd = fd;
+}
+
+void *access_log_thread(void *arg) {
+	(void)arg;
+	struct pollfd wakeup = {.fd = access_log_wakeup, .events = POLLIN};
+
+	for(;;) {
+		// Write out whatever has piled up every so often, or right away once the ring buffer is filling up
+		poll(&wakeup, 1, ACCESS_LOG_INTERVAL);
+		uint64_t count;
+		if(read(access_log_wakeup, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+			perror("read");
+		}
+
+		if(reopen_requested) {
+			reopen_requested = 0;
+			open_access_log();
+		}
+
+		size_t head = atomic_load_explicit(&access_log_head, memory_order_relaxed);
+		size_t tail = atomic_load_explicit(&access_log_tail, memory_order_acquire);
+		while(head != tail) {
+			struct iovec iov[2];
+			size_t offset = head % ACCESS_LOG_SIZE;
+			size_t first = tail - head < ACCESS_LOG_SIZE - offset ? tail - head : ACCESS_LOG_SIZE - offset;
+			iov[0].iov_base = access_log_ring + offset;
+			iov[0].iov_len = first;
+			iov[1].iov_base = access_log_ring;
+			iov[1].iov_len = tail - head - first;
+
+			ssize_t amount = writev(access_log_fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+			if(amount <= 0) {
+				// Disk full or similar, the lines are lost either way and holding on to them would only stall the event loop
+				log_error("%s: Could not write access log: %s\n", program_name, strerror(errno));
+				amount = tail - head;
+			}
+			head += amount;
+			atomic_store_explicit(&access_log_head, head, memory_order_release);
+		}
+	}
+
+	return NULL;
+}
+
+void start_access_log(void) {
+	access_log_ring = malloc(ACCESS_LOG_SIZE);
+	if(access_log_ring == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	access_log_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(access_log_wakeup == -1) {
+		perror("eventfd");
+		exit(1);
+	}
+
+	pthread_t writer;
+	int status = pthread_create(&writer, NULL, access_log_thread, NULL);
+	if(status != 0) {
+		log_error("%s: pthread_create failed: %s\n", program_name, strerror(status));
+		exit(1);
+	}
+	pthread_detach(writer);
+}
+
+void access_log_append(const char *line, size_t size) {
+	size_t head = atomic_load_explicit(&access_log_head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&access_log_tail, memory_order_relaxed);
+	if(size > ACCESS_LOG_SIZE - (tail - head)) {
+		metrics->access_log_dropped++;
+		return;
+	}
+
+	size_t offset = tail % ACCESS_LOG_SIZE;
+	size_t first = size < ACCESS_LOG_SIZE - offset ? size : ACCESS_LOG_SIZE - offset;
+	memcpy(access_log_ring + offset, line, first);
+	memcpy(access_log_ring, line + first, size - first);
+	atomic_store_explicit(&access_log_tail, tail + size, memory_order_release);
+
+	// Wake the writer early when crossing half full, otherwise it comes round soon enough on its own
+	if(tail - head < ACCESS_LOG_SIZE / 2 && tail + size - head >= ACCESS_LOG_SIZE / 2) {
+		uint64_t one = 1;
+		if(write(access_log_wakeup, &one, sizeof(one)) == -1) {
+			perror("write");
+		}
+	}
+}
+
+size_t log_escape(char *out, size_t room, const char *data, size_t size) {
+	// Quotes, backslashes and anything unprintable are escaped, so every request stays on a line of its own and can be parsed back
+	size_t length = 0;
+	for(size_t i = 0; i < size; i++) {
+		unsigned char c = data[i];
+		char escaped[5];
+		size_t escaped_size;
+		if(c == '"' || c == '\\') {
+			escaped[0] = '\\';
+			escaped[1] = c;
+			escaped_size = 2;
+		} else if(c < 0x20 || c >= 0x7f) {
+			escaped_size = snprintf(escaped, sizeof(escaped), "\\x%02x", c);
+		} else {
+			escaped[0] = c;
+			escaped_size = 1;
+		}
+
+		if(length + escaped_size > room) {
+			break;
+		}
+		memcpy(out + length, escaped, escaped_size);
+		length += escaped_size;
+	}
+	return length;
+}
+
+void log_access(struct connection *conn) {
+	// One line per request, as key=value pairs
+	char line[ACCESS_LOG_LINE_MAX];
+	size_t size = 0;
+
+	time_t now = time(NULL);
+	struct tm tm;
+	gmtime_r(&now, &tm);
+	size += strftime(line, sizeof(line), "time=%Y-%m-%dT%H:%M:%SZ", &tm);
+
+	char host[NI_MAXHOST] = "-";
+	getnameinfo((struct sockaddr *)&conn->client_address, conn->client_address_size, host, sizeof(host), NULL, 0, NI_NUMERICHOST);
+	size += snprintf(line + size, sizeof(line) - size, " client=%s method=\"", host);
+	size += log_escape(line + size, 16, conn->request.method.data, conn->request.method.size);
+
+	// The selector gets whatever room is left after the fixed-size fields
+	size += snprintf(line + size, sizeof(line) - size, "\" itemtype=\"");
+	size += log_escape(line + size, 4, &conn->itemtype, conn->path != NULL ? 1 : 0);
+	size += snprintf(line + size, sizeof(line) - size, "\" selector=\"");
+	size += log_escape(line + size, sizeof(line) - size - 128, conn->path, conn->path != NULL ? conn->path_size : 0);
+
+	char upstream[32] = "-";
+	if(conn->first_byte) {
+		snprintf(upstream, sizeof(upstream), "%.6f", conn->first_byte_latency / 1e6);
+	}
+	size += snprintf(line + size, sizeof(line) - size, "\" status=%d bytes=%llu upstream=%s duration=%.6f\n", conn->status, conn->bytes_sent, upstream, (monotonic_us() - conn->request_start) / 1e6);
+
+	if(size >= sizeof(line)) {
+		size = sizeof(line) - 1;
+		line[size - 1] = '\n';
+	}
+	access_log_append(line, size);
+}
+
+void clear_request(struct connection *conn) {
+	// Let go of everything belonging to the request being handled, leaving the connection ready for the next one
+	// Prefetches aren't requests of any client
+	if(conn->request_start != 0 && !conn->prefetch) {
+		if(access_log_fd != -1) {
+			log_access(conn);
+		}
+		histogram_observe(&metrics->request_duration, monotonic_us() - conn->request_start);
+		metrics->sent_bytes[(unsigned char)conn->itemtype] += conn->bytes_sent;
+		if(!conn->completed) {
+			metrics->errors[ABORTED]++;
+		}
+	}
+	conn->request_start = 0;
+	conn->connect_start = 0;
+	conn->first_byte = false;
+	conn->first_byte_latency = 0;
+	conn->bytes_sent = 0;
+	conn->completed = false;
+	conn->status = 0;
+
+	if(conn->response_body != NULL) {
+		free(conn->response_body);
+		conn->response_body = NULL;
+	}
+	conn->response_body_size = 0;
+
+	close_remote(conn);
+
+	release_addresses(conn);
+	backend_release(conn);
+	conn->backends_tried = 0;
+	conn->current_address = NULL;
+	conn->first_address = NULL;
+	conn->next_address = NULL;
+	conn->started_addresses = false;
+	conn->timed_out = false;
+
+	conn->path = NULL;
+	conn->path_size = 0;
+
+	conn->buffer = NULL;
+	conn->buffer_size = 0;
+	conn->written = 0;
+	conn->arena_used = 0;
+
+	conn->ring.data = NULL;
+	conn->gophermap = NULL;
+
+	if(conn->encoder != NULL) {
+		put_encoder(conn->encoder);
+		conn->encoder = NULL;
+	}
+	conn->encoding = IDENTITY;
+
+	conn->validated = false;
+	conn->range_start = 0;
+	conn->range_end = 0;
+
+	if(conn->pipe_pair.read_fd != -1) {
+		put_pipe(&conn->pipe_pair, conn->pipe_fill == 0);
+	}
+	conn->pipe_fill = 0;
+
+	conn->chunked = false;
+	conn->chunk_left = 0;
+	conn->frame_size = 0;
+	conn->frame_written = 0;
+
+	if(conn->capture != NULL) {
+		free(conn->capture);
+		conn->capture = NULL;
+	}
+	conn->capturing = false;
+	conn->capture_checksum = 0;
+	conn->capture_size = 0;
+	conn->capture_allocated = 0;
+
+	if(conn->capture_fd != -1) {
+		// Incomplete, throw it away
+		close(conn->capture_fd);
+		unlink(conn->capture_path);
+		conn->capture_fd = -1;
+	}
+
+	if(conn->capture_path != NULL) {
+		free(conn->capture_path);
+		conn->capture_path = NULL;
+	}
+
+	if(conn->file_fd != -1) {
+		close(conn->file_fd);
+		conn->file_fd = -1;
+	}
+
+	if(conn->cache_entry != NULL) {
+		cache_release(conn->cache_entry);
+		conn->cache_entry = NULL;
+	}
+
+	flight_release(conn);
+}
+
+void remove_connection(struct connection *conn) {
+	// Clean the connection up
+	TRACE3(close, conn->id, conn->state, conn->bytes_sent);
+	if(conn->client.fd != -1) {
+		unwatch_socket(&conn->client);
+		close(conn->client.fd);
+	}
+
+	clear_request(conn);
+	if(conn->prefetch) {
+		prefetch.running--;
+	} else {
+		metrics->connections[conn->state]--;
+	}
+	set_timeout(conn, NO_TIMEOUT);
+
+	// Queue the connection to be freed after the current batch of events
+	conn->closed = true;
+	conn->next_closed = closed_connections;
+	closed_connections = conn;
+}
+
+bool finish_response(struct connection *conn) {
+	// The response is complete, so either close the connection or go on to the next request, which may already be waiting
+	// Returns whether the connection is still around
+	conn->completed = true;
+	TRACE3(response, conn->id, conn->status, conn->bytes_sent);
+	if(!conn->keep_alive) {
+		remove_connection(conn);
+		return false;
+	}
+
+	clear_request(conn);
+
+	// Move whatever followed the request, the beginning of the next one, to the front
+	size_t left_over = conn->request_size - conn->request.size;
+	memmove(conn->request_buffer, conn->request_buffer + conn->request.size, left_over);
+	conn->request_size = left_over;
+	memset(&conn->request, 0, sizeof(conn->request));
+
+	set_state(conn, START);
+	set_timeout(conn, HEADER_TIMEOUT);
+	return true;
+}
+
+void free_closed_connections(void) {
+	while(closed_connections != NULL) {
+		struct connection *conn = closed_connections;
+		closed_connections = conn->next_closed;
+		put_connection(conn);
+	}
+}
+
+void add_listen(struct addrinfo *res) {
+	const int yes = 1;
+
+	// Create socket
+	int sock = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK, res->ai_protocol);
+	if(sock == -1) {
+		perror("socket");
+		exit(1);
+	}
+
+	// Disable the IPv4 over IPv6, as that results in IPv4 and IPv6 sockets conflicting and one of them not being able to be set up
+	if(res->ai_family == AF_INET6) {
+		if(setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes)) == -1) {
+			perror("setsockopt");
+			exit(1);
+		}
+	}
+
+	// Set reuseaddr
+	if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
+		perror("setsockopt");
+		exit(1);
+	}
+
+	// With worker processes every worker has its own listening socket on the same address, and the kernel spreads connections between them
+	if(workers > 0) {
+		if(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+			perror("setsockopt");
+			exit(1);
+		}
+	}
+
+	// Bind onto given address
+	if(bind(sock, res->ai_addr, res->ai_addrlen) == -1) {
+		perror("bind");
+		exit(1);
+	}
+
+	// Listen for incoming connections, letting the kernel queue up a burst of them for us (up to net.core.somaxconn)
+	if(listen(sock, listen_backlog) == -1) {
+		perror("listen");
+		exit(1);
+	}
+
+	// Listening sockets live as long as the process does, so their handles are never freed
+	struct handle *handle = calloc(1, sizeof(struct handle));
+	if(handle == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	handle->type = LISTEN_HANDLE;
+	handle->fd = sock;
+	handle->events = POLLIN;
+
+	// Add it to the table of listening sockets, it gets added to the event engine once the process that uses it is running
+	listeners = realloc(listeners, (number_listeners + 1) * sizeof(*listeners));
+	if(listeners == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+	listeners[number_listeners++] = handle;
+}
+
+void setup_listen(unsigned long port) {
+	char port_string[6];
+
+	// getaddrinfo wants port as a string, so stringify it
+	if(!stringify_port(port, port_string, sizeof(port_string))) {
+		log_error("%s: Could not convert %li to string\n", program_name, port);
+		exit(1);
+	}
+
+	struct addrinfo hints;
+	struct addrinfo *getaddrinfo_result;
+
+	// AF_UNSPEC: either IPv4 or IPv6
+	// SOCK_STREAM: TCP
+	// AI_PASSIVE: fill out my IP for me
+	// AI_ADDRCONFIG: only return addresses I have a configured interface for
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
+
+	int status = getaddrinfo(NULL, port_string, &hints, &getaddrinfo_result);
+
+	if(status != 0) {
+		log_error("%s: getaddrinfo failed: %s\n", program_name, gai_strerror(status));
+		exit(1);
+	}
+
+	for(struct addrinfo *res = getaddrinfo_result; res != NULL; res = res->ai_next) {
+		// Add corresponding interface to the table of listening sockets
+		add_listen(res);
+	}
+
+	freeaddrinfo(getaddrinfo_result);
+}
+
+long long int open_connections(void) {
+	long long int total = 0;
+	for(size_t i = 0; i < number_metrics; i++) {
+		for(size_t state = 0; state < NUMBER_STATES; state++) {
+			total += all_metrics[i].connections[state];
+		}
+	}
+	return total;
+}
+
+void listener_interest(short events) {
+	for(size_t i = first_own_listener; i < first_own_listener + number_own_listeners; i++) {
+		struct handle *handle = listeners[i];
+		if(engine == EPOLL_ENGINE) {
+			struct epoll_event event = {.events = events & POLLIN ? EPOLLIN : 0, .data.ptr = handle};
+			if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, handle->fd, &event) == -1) {
+				perror("epoll_ctl");
+				exit(1);
+			}
+			handle->events = events;
+		} else {
+			socket_interest(handle, events);
+		}
+	}
+}
+
+void pause_accepting(long long int retry) {
+	// Connections keep queueing up in the kernel meanwhile
+	accepting = false;
+	accept_retry = monotonic_ms() + retry;
+	listener_interest(0);
+}
+
+void resume_accepting(void) {
+	if(monotonic_ms() < accept_retry || (max_connections > 0 && open_connections() >= max_connections)) {
+		return;
+	}
+	accepting = true;
+	listener_interest(POLLIN);
+}
+
+void accept_connections(struct handle *listener) {
+	// Take every connection that's waiting rather than one per wakeup, for as long as we're under the limit
+	while(accepting) {
+		if(max_connections > 0 && open_connections() >= max_connections) {
+			pause_accepting(0);
+			return;
+		}
+
+		struct sockaddr_storage client_addr;
+		socklen_t addr_size = sizeof(client_addr);
+		int sock = accept4(listener->fd, (struct sockaddr *)&client_addr, &addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(sock == -1) {
+			if(errno == EINTR || errno == ECONNABORTED) {
+				// The client went away before we got to it
+				continue;
+			}
+			if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+				// Out of file descriptors or memory, try again once some connections may have closed
+				if(!accept_exhausted) {
+					log_error("%s: accept: %s, pausing accepting connections\n", program_name, strerror(errno));
+					accept_exhausted = true;
+				}
+				pause_accepting(ACCEPT_RETRY);
+			}
+			return;
+		}
+
+		accept_exhausted = false;
+		add_connection(sock, (struct sockaddr *)&client_addr, addr_size);
+	}
+}
+
+struct addrinfo *resolve_backend(struct backend *backend) {
+	struct addrinfo hints;
+	struct addrinfo *getaddrinfo_result;
+
+	// AF_UNSPEC: either IPv4 or IPv6
+	// SOCK_STREAM: TCP
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int status = getaddrinfo(backend->host, backend->port_string, &hints, &getaddrinfo_result);
+
+	if(status != 0) {
+		log_error("%s: getaddrinfo failed for %s: %s\n", program_name, backend->host, gai_strerror(status));
+		return NULL;
+	}
+
+	return getaddrinfo_result;
+}
+
+void *resolver_thread(void *arg) {
+	(void)arg;
+
+	pthread_mutex_lock(&resolver_mutex);
+	for(;;) {
+		long long int started = monotonic_ms();
+		refresh_requested = false;
+
+		bool all_resolved = true;
+		for(size_t i = 0; i < number_backends; i++) {
+			struct backend *backend = &backends[i];
+			pthread_mutex_unlock(&resolver_mutex);
+			struct addrinfo *addresses = resolve_backend(backend);
+			pthread_mutex_lock(&resolver_mutex);
+
+			// Hand the result over to the event loop, replacing a previous one it hasn't picked up yet
+			if(backend->resolved_addresses != NULL) {
+				freeaddrinfo(backend->resolved_addresses);
+			}
+			backend->resolved_addresses = addresses;
+			backend->resolved = true;
+			all_resolved = all_resolved && addresses != NULL;
+
+			uint64_t one = 1;
+			if(write(resolver_handle.fd, &one, sizeof(one)) == -1) {
+				perror("write");
+				exit(1);
+			}
+		}
+
+		// Sleep until the results expire or the event loop asks for a refresh, retrying failed lookups sooner
+		// Don't look up more than once a second, however much we get asked, so a refresh asked for sooner waits out the rest of that second
+		long long int expires = monotonic_ms() + (all_resolved ? resolve_ttl : 1) * 1000LL;
+		for(;;) {
+			long long int until = expires;
+			if(refresh_requested && started + 1000 < until) {
+				until = started + 1000;
+			}
+			struct timespec deadline = {.tv_sec = until / 1000, .tv_nsec = until % 1000 * 1000000};
+			if(pthread_cond_timedwait(&resolver_cond, &resolver_mutex, &deadline) == ETIMEDOUT) {
+				break;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+void request_refresh(void) {
+	pthread_mutex_lock(&resolver_mutex);
+	refresh_requested = true;
+	pthread_cond_signal(&resolver_cond);
+	pthread_mutex_unlock(&resolver_mutex);
+}
+
+void setup_resolver(void) {
+	resolver_handle.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(resolver_handle.fd == -1) {
+		perror("eventfd");
+		exit(1);
+	}
+	watch_socket(&resolver_handle);
+
+	pthread_condattr_t attributes;
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&resolver_cond, &attributes);
+	pthread_condattr_destroy(&attributes);
+
+	// The resolver thread does all lookups, so the event loop never waits on them
+	pthread_t resolver;
+	int status = pthread_create(&resolver, NULL, resolver_thread, NULL);
+	if(status != 0) {
+		log_error("%s: pthread_create failed: %s\n", program_name, strerror(status));
+		exit(1);
+	}
+	pthread_detach(resolver);
+}
+
+struct addrinfo *take_address(struct connection *conn) {
+	// Try the address we last connected to successfully first, and then the rest in the order getaddrinfo gave them
+	if(!conn->started_addresses) {
+		conn->started_addresses = true;
+		conn->first_address = conn->addresses->preferred;
+		conn->next_address = conn->addresses->addresses;
+		if(conn->first_address != NULL) {
+			return conn->first_address;
+		}
+	}
+
+	while(conn->next_address != NULL) {
+		struct addrinfo *res = conn->next_address;
+		conn->next_address = res->ai_next;
+		if(res != conn->first_address) {
+			return res;
+		}
+	}
+
+	return NULL;
+}
+
+bool same_address(struct addrinfo *a, struct addrinfo *b) {
+	return a->ai_addrlen == b->ai_addrlen && memcmp(a->ai_addr, b->ai_addr, a->ai_addrlen) == 0;
+}
+
+void send_error(struct connection *conn, enum error_cause cause) {
+	// Replace whatever was in the buffer with a complete response, after which the connection is closed
+	// A prefetch has no client to send it to, so that fails and closes it
+	if(!conn->prefetch) {
+		metrics->errors[cause]++;
+	}
+	const char *status = error_causes[cause].status;
+	conn->status = atoi(status);
+	conn->buffer = arena_printf(conn, &conn->buffer_size, "HTTP/1.1 %s\r\nContent-type: text/plain; charset=utf-8\r\nContent-length: %zu\r\nConnection: close\r\n\r\n%s\n", status, strlen(status) + 1, status);
+	conn->written = 0;
+	conn->keep_alive = false;
+
+	set_state(conn, RESPONSE_WRITE);
+}
+
+enum copymode get_copymode(char itemtype) {
+	if(itemtype == '1') { // Gopher directory listing
+		return GOPHERMAP;
+	} else if(itemtype == '0' || itemtype == '4' || itemtype == '6' || itemtype == 'h') { // Text file, UUEncoded file, HTML document
+		return TEXT;
+	} else {
+		return BINARY;
+	}
+}
+
+bool compressible(char itemtype) {
+	// Binary bodies are left alone, they're either compressed already or not worth it
+	return compression_level > 0 && get_copymode(itemtype) != BINARY;
+}
+
+bool coding_refused(const char *parameters, size_t size) {
+	// Whether the parameters following a content coding in Accept-Encoding, e.g. ;q=0, rule it out
+	const char *end = parameters + size;
+	while(parameters < end) {
+		const char *semicolon = memchr(parameters, ';', end - parameters);
+		const char *parameter = parameters;
+		const char *parameter_end = semicolon != NULL ? semicolon : end;
+		parameters = parameter_end + (semicolon != NULL);
+
+		while(parameter < parameter_end && (*parameter == ' ' || *parameter == '\t')) {
+			parameter++;
+		}
+		while(parameter_end > parameter && (parameter_end[-1] == ' ' || parameter_end[-1] == '\t')) {
+			parameter_end--;
+		}
+		if(parameter_end - parameter < 3 || tolower((unsigned char)parameter[0]) != 'q' || parameter[1] != '=') {
+			continue;
+		}
+
+		// A q value of zero, with as many zeros after the point as it likes
+		const char *value = parameter + 2;
+		if(value[0] != '0') {
+			return false;
+		}
+		for(value++; value < parameter_end; value++) {
+			if(*value != '0' && *value != '.') {
+				return false;
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+enum content_encoding negotiate_encoding(struct connection *conn, off_t content_length) {
+	// Compress the body if the client accepts gzip or deflate, preferring gzip, unless it's known to be too small to be worth it
+	if(!compressible(conn->itemtype) || (content_length >= 0 && content_length < compression_min_size)) {
+		return IDENTITY;
+	}
+
+	struct slice header = conn->request.accept_encoding;
+	enum content_encoding encoding = IDENTITY;
+	const char *end = header.data + header.size;
+	const char *coding = header.data;
+	while(coding != NULL && coding < end) {
+		const char *comma = memchr(coding, ',', end - coding);
+		const char *coding_end = comma != NULL ? comma : end;
+
+		while(coding < coding_end && (*coding == ' ' || *coding == '\t')) {
+			coding++;
+		}
+		const char *semicolon = memchr(coding, ';', coding_end - coding);
+		const char *name_end = semicolon != NULL ? semicolon : coding_end;
+		while(name_end > coding && (name_end[-1] == ' ' || name_end[-1] == '\t')) {
+			name_end--;
+		}
+		size_t name_size = name_end - coding;
+
+		if(semicolon == NULL || !coding_refused(semicolon + 1, coding_end - semicolon - 1)) {
+			if((name_size == 4 && strncasecmp(coding, "gzip", 4) == 0) || (name_size == 6 && strncasecmp(coding, "x-gzip", 6) == 0) || (name_size == 1 && *coding == '*')) {
+				encoding = GZIP;
+			} else if(name_size == 7 && strncasecmp(coding, "deflate", 7) == 0 && encoding == IDENTITY) {
+				encoding = DEFLATE;
+			}
+		}
+
+		coding = comma != NULL ? comma + 1 : NULL;
+	}
+	return encoding;
+}
+
+const char *status_line(int status) {
+	if(status == 206) {
+		return "206 Partial Content";
+	} else if(status == 304) {
+		return "304 Not Modified";
+	} else if(status == 416) {
+		return "416 Range Not Satisfiable";
+	}
+	return "200 OK";
+}
+
+void format_etag(struct connection *conn, char *buffer, size_t size) {
+	// Each content coding is a body of its own, and gets an ETag of its own
+	const char *suffixes[NUMBER_ENCODINGS] = {"", "-gzip", "-deflate"};
+	snprintf(buffer, size, "\"%llx-%08lx%s\"", (long long int)conn->checksum_size, (unsigned long int)conn->checksum, suffixes[conn->encoding]);
+}
+
+void format_http_date(time_t time, char *buffer, size_t size) {
+	struct tm tm;
+	gmtime_r(&time, &tm);
+	strftime(buffer, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+void response_header(struct connection *conn, const char *mimetype, off_t content_length) {
+	// Put the response header in the buffer, framing the body with its length if known, or as chunks otherwise
+	// Clients that don't know about chunks get the body up to EOF instead, and the connection closed
+	// A body known up front comes with its validators, and with a 206, 304 or 416 may be sent in part or not at all
+	if(conn->status == 0) {
+		conn->status = 200;
+	}
+
+	const char *framing = "";
+	char length_header[48];
+	if(conn->status == 304) {
+		// No body, so no framing
+	} else if(conn->status == 206 || conn->status == 416) {
+		snprintf(length_header, sizeof(length_header), "Content-length: %lld\r\n", (long long int)(conn->range_end - conn->range_start));
+		framing = length_header;
+	} else if(content_length >= 0) {
+		snprintf(length_header, sizeof(length_header), "Content-length: %lld\r\n", (long long int)content_length);
+		framing = length_header;
+	} else if(conn->http_minor >= 1) {
+		framing = "Transfer-encoding: chunked\r\n";
+		conn->chunked = true;
+	} else {
+		conn->keep_alive = false;
+	}
+
+	const char *connection = "";
+	if(!conn->keep_alive) {
+		connection = "Connection: close\r\n";
+	} else if(conn->http_minor < 1) {
+		connection = "Connection: keep-alive\r\n";
+	}
+
+	// Whether the body gets compressed depends on Accept-Encoding, which caches along the way need to know
+	const char *vary = compressible(conn->itemtype) ? "Vary: Accept-Encoding\r\n" : "";
+
+	char validators[160] = "";
+	if(conn->validated) {
+		char etag[48];
+		char date[40];
+		format_etag(conn, etag, sizeof(etag));
+		format_http_date(conn->modified, date, sizeof(date));
+		snprintf(validators, sizeof(validators), "ETag: %s\r\nLast-modified: %s\r\nAccept-ranges: bytes\r\n", etag, date);
+	}
+
+	char content_range[80] = "";
+	if(conn->status == 206) {
+		snprintf(content_range, sizeof(content_range), "Content-range: bytes %lld-%lld/%lld\r\n", (long long int)conn->range_start, (long long int)conn->range_end - 1, (long long int)content_length);
+	} else if(conn->status == 416) {
+		snprintf(content_range, sizeof(content_range), "Content-range: bytes */%lld\r\n", (long long int)content_length);
+	}
+
+	const char *type_header = conn->status == 304 ? "" : "Content-type: ";
+	const char *type = conn->status == 304 ? "" : mimetype;
+	const char *type_end = conn->status == 304 ? "" : "\r\n";
+	conn->buffer = arena_printf(conn, &conn->buffer_size, "HTTP/1.1 %s\r\n%s%s%s%s%s%s%s%s%s\r\n", status_line(conn->status), type_header, type, type_end, encoding_headers[conn->encoding], vary, validators, content_range, framing, connection);
+	conn->written = 0;
+}
+
+void remote_connected(struct connection *conn) {
+	set_timeout(conn, NO_TIMEOUT);
+
+	long long int duration = monotonic_us() - conn->connect_start;
+	histogram_observe(&metrics->connect_duration, duration);
+	histogram_observe(&metrics->backend_connect_duration[conn->backend - backends], duration);
+	conn->backend->failures = 0;
+
+	// Remember the address that worked, so the following connections try it first
+	conn->addresses->preferred = conn->current_address;
+	release_addresses(conn);
+
+	set_state(conn, REQUEST_WRITE);
+}
+
+void backend_failed(struct backend *backend) {
+	metrics->backend_failures[backend - backends]++;
+
+	// Without probes nothing would ever bring the backend back, so it's only ejected with them
+	if(++backend->failures >= HEALTH_FAILURES && backend->healthy && health_interval > 0) {
+		log_error("%s: Backend %s failing, ejecting it\n", program_name, backend->name);
+		backend->healthy = false;
+		metrics->backend_ejected[backend - backends] = 1;
+	}
+}
+
+long long int backend_load(struct backend *backend) {
+	// Requests in progress on the backend, across all workers
+	long long int total = 0;
+	for(size_t i = 0; i < number_metrics; i++) {
+		total += all_metrics[i].backend_connections[backend - backends];
+	}
+	return total;
+}
+
+uint64_t mix_hash(uint64_t hash) {
+	// Finaliser of splitmix64, so hashes that only differ in a few bits end up entirely different
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+	return hash ^ (hash >> 31);
+}
+
+struct backend *choose_backend(struct connection *conn, bool healthy_only) {
+	// Of the backends with addresses that the request hasn't failed on yet, and are healthy if asked for, the one to use
+	// With the selector hash that's the one scoring highest for the selector (rendezvous hashing), so only the items of a backend that goes away move elsewhere
+	uint64_t selector_hash = cache_hash(0, conn->path, conn->path_size);
+	struct backend *chosen = NULL;
+	long long int chosen_load = 0;
+	uint64_t chosen_score = 0;
+	for(size_t n = 0; n < number_backends; n++) {
+		// Least connections goes round the backends starting after the last one chosen, so ties get spread out
+		size_t i = (last_backend + 1 + n) % number_backends;
+		struct backend *backend = &backends[i];
+		if(backend->addresses == NULL || (conn->backends_tried & (1ULL << i)) || (healthy_only && !backend->healthy)) {
+			continue;
+		}
+
+		if(balance == SELECTOR_HASH) {
+			uint64_t score = mix_hash(selector_hash ^ backend->hash);
+			if(chosen == NULL || score > chosen_score) {
+				chosen = backend;
+				chosen_score = score;
+			}
+		} else {
+			long long int load = backend_load(backend);
+			if(chosen == NULL || load < chosen_load) {
+				chosen = backend;
+				chosen_load = load;
+			}
+		}
+	}
+	return chosen;
+}
+
+bool use_backend(struct connection *conn) {
+	// Pick the backend to try next and take its addresses, returning false if there is none to try (yet)
+	// Healthy backends first, but rather an ejected one than none at all
+	struct backend *backend = choose_backend(conn, true);
+	if(backend == NULL) {
+		backend = choose_backend(conn, false);
+	}
+
+	if(backend == NULL) {
+		for(size_t i = 0; i < number_backends; i++) {
+			if(backends[i].addresses == NULL && !backends[i].lookup_failed && !(conn->backends_tried & (1ULL << i))) {
+				// Nothing resolved yet, wait for the resolver thread
+				resolving_push(conn);
+				set_timeout(conn, CONNECT_TIMEOUT);
+				set_state(conn, RESOLVING);
+				return false;
+			}
+		}
+
+		// Every backend has failed the request, or none can be resolved
+		send_error(conn, conn->backends_tried == 0 ? NO_ADDRESSES : conn->timed_out ? CONNECT_TIMED_OUT : CONNECT_FAILED);
+		return false;
+	}
+
+	last_backend = backend - backends;
+	conn->backend = backend;
+	conn->backends_tried |= 1ULL << last_backend;
+	metrics->backend_connections[last_backend]++;
+	metrics->backend_requests[last_backend]++;
+
+	// Keep the addresses around for as long as we're trying them, even if they get replaced meanwhile
+	conn->addresses = backend->addresses;
+	conn->addresses->references++;
+	conn->started_addresses = false;
+	return true;
+}
+
+void connect_next(struct connection *conn) {
+	// Give up on the current attempt, if any
+	close_remote(conn);
+
+	// Every address of the backend, and then those of the next backend the request hasn't failed on yet
+	struct addrinfo *res;
+	for(;;) {
+		while(conn->addresses != NULL && (res = take_address(conn)) != NULL) {
+			// Create socket
+			int sock = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+			if(sock == -1) {
+				perror("socket");
+				continue;
+			}
+
+			// Start connecting to remote, without waiting for it to complete
+			int status = connect(sock, res->ai_addr, res->ai_addrlen);
+			if(status == -1 && errno != EINPROGRESS) {
+				close(sock);
+				continue;
+			}
+
+			conn->current_address = res;
+			conn->remote.fd = sock;
+			conn->remote.events = POLLOUT;
+			conn->remote.revents = 0;
+			watch_socket(&conn->remote);
+
+			if(status == 0) {
+				// Connected right away, which can happen with local remotes
+				remote_connected(conn);
+			} else {
+				set_timeout(conn, CONNECT_TIMEOUT);
+				set_state(conn, CONNECTING);
+			}
+			return;
+		}
+
+		// Ran out of addresses to try, maybe the backend has moved
+		release_addresses(conn);
+		request_refresh();
+		if(conn->backend == NULL) {
+			// Timed out waiting for addresses
+			send_error(conn, conn->timed_out ? CONNECT_TIMED_OUT : CONNECT_FAILED);
+			return;
+		}
+
+		// Go on to another backend, if there's one left
+		backend_failed(conn->backend);
+		backend_release(conn);
+		if(!use_backend(conn)) {
+			return;
+		}
+	}
+}
+
+void start_connect(struct connection *conn) {
+	if(use_backend(conn)) {
+		connect_next(conn);
+	}
+}
+
+bool recognised_itemtype(char itemtype) {
+	return (
+		itemtype == '0' || // Text file
+		itemtype == '1' || // Gopher directory listing
+		itemtype == '4' || // BinHex archive
+		itemtype == '5' || // Binary archive
+		itemtype == '6' || // UUEncoded file
+		itemtype == '9' || // Binary file
+		itemtype == 'g' || // GIF image
+		itemtype == 'h' || // HTML document
+		itemtype == 'I' || // Image (generic)
+		itemtype == 's' // Sound
+	);
+}
+
+void get_itemtype_selector(char *itemtype, const char **selector, size_t *selector_length, const char *path, size_t path_length) {
+	const char *start = path;
+	size_t left = path_length;
+
+	// Ignore a / on the beginning of path
+	if(left > 0 && start[0] == '/') {
+		start++;
+		left--;
+	}
+
+	// Special case: null-length selector has itemtype 1
+	// Otherwise, if we recognise the first character of path as itemtype -> save it as itemtype and move selector's beginning one forward
+	// If not, set itemtype to default itemtype and don't move beginning of selector
+	if(left == 0) {
+		*itemtype = '1';
+	} else if(left >= 1 && recognised_itemtype(start[0])) {
+		*itemtype = start[0];
+		start++;
+		left--;
+	} else {
+		*itemtype = default_itemtype;
+	}
+
+	// The rest of path is the selector
+	*selector = start;
+	*selector_length = left;
+}
+
+const char *get_mimetype(char itemtype, const char *selector, size_t selector_length) {
+	// Special handling for itemtype 1, which gets translated into HTML
+	if(itemtype == '1') {
+		return "text/html; charset=utf-8";
+	}
+
+	// Special handling for itemtypes I and s
+	if(itemtype == 'I' || itemtype == 's') {
+		const char *extension = memrchr(selector, '.', selector_length);
+		if(extension == NULL) {
+			// There is no extension, everything is a lie
+			return default_mimetype;
+		}
+
+		// Compared where it is in the selector
+		size_t extension_length = selector_length - (extension - selector);
+		for(size_t i = 0; i < sizeof(extension_mimetypes) / sizeof(*extension_mimetypes); i++) {
+			if(strlen(extension_mimetypes[i].ext) == extension_length && memcmp(extension, extension_mimetypes[i].ext, extension_length) == 0) {
+				return extension_mimetypes[i].mimetype;
+			}
+		}
+
+		// Unrecognised extension
+		return default_mimetype;
+	}
+
+	for(size_t i = 0; i < sizeof(mimetypes) / sizeof(*mimetypes); i++) {
+		if(itemtype == mimetypes[i].itemtype) {
+			return mimetypes[i].mimetype;
+		}
+	}
+
+	// Nothing matched
+	return default_mimetype;
+}
+
+void ring_setup(struct ring *ring, char *data, size_t size) {
+	ring->data = data;
+	ring->size = size;
+	ring->start = 0;
+	ring->fill = 0;
+}
+
+int ring_free_iov(struct ring *ring, struct iovec iov[2]) {
+	// Free space starts after the data and may wrap around to before it
+	size_t end = (ring->start + ring->fill) % ring->size;
+	size_t free_space = ring->size - ring->fill;
+	size_t contiguous = ring->size - end < free_space ? ring->size - end : free_space;
+
+	iov[0].iov_base = ring->data + end;
+	iov[0].iov_len = contiguous;
+	iov[1].iov_base = ring->data;
+	iov[1].iov_len = free_space - contiguous;
+	return iov[1].iov_len != 0 ? 2 : 1;
+}
+
+int ring_data_iov(struct ring *ring, struct iovec iov[2]) {
+	// Data starts at ring->start and may wrap around to the beginning
+	size_t contiguous = ring->size - ring->start < ring->fill ? ring->size - ring->start : ring->fill;
+
+	iov[0].iov_base = ring->data + ring->start;
+	iov[0].iov_len = contiguous;
+	iov[1].iov_base = ring->data;
+	iov[1].iov_len = ring->fill - contiguous;
+	return iov[1].iov_len != 0 ? 2 : 1;
+}
+
+size_t ring_peek(struct ring *ring, size_t offset, char *buffer, size_t size) {
+	size_t amount = offset >= ring->fill ? 0 : size < ring->fill - offset ? size : ring->fill - offset;
+	for(size_t i = 0; i < amount; i++) {
+		buffer[i] = ring->data[(ring->start + offset + i) % ring->size];
+	}
+	return amount;
+}
+
+void ring_consume(struct ring *ring, size_t amount) {
+	ring->start = (ring->start + amount) % ring->size;
+	ring->fill -= amount;
+
+	// Keep the data contiguous for as long as possible
+	if(ring->fill == 0) {
+		ring->start = 0;
+	}
+}
+
+size_t find_newline_period_scalar(const char *data, size_t size) {
+	// Find a \n followed by a period, returning the position of the \n or size if there is none
+	const char *end = data + size;
+	const char *newline = data;
+	while(size > 1 && (newline = memchr(newline, '\n', end - newline - 1)) != NULL) {
+		if(newline[1] == '.') {
+			return newline - data;
+		}
+		newline++;
+	}
+	return size;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) size_t find_newline_period_sse2(const char *data, size_t size) {
+	// Compare 16 bytes against \n and the 16 bytes after them against a period at a time
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i period = _mm_set1_epi8('.');
+	size_t i = 0;
+	for(; i + 17 <= size; i += 16) {
+		__m128i here = _mm_loadu_si128((const __m128i *)(data + i));
+		__m128i next = _mm_loadu_si128((const __m128i *)(data + i + 1));
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(here, newline), _mm_cmpeq_epi8(next, period)));
+		if(mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	size_t rest = find_newline_period_scalar(data + i, size - i);
+	return i + rest;
+}
+
+__attribute__((target("avx2"))) size_t find_newline_period_avx2(const char *data, size_t size) {
+	// Same as the SSE2 version, 32 bytes at a time
+	const __m256i newline = _mm256_set1_epi8('\n');
+	const __m256i period = _mm256_set1_epi8('.');
+	size_t i = 0;
+	for(; i + 33 <= size; i += 32) {
+		__m256i here = _mm256_loadu_si256((const __m256i *)(data + i));
+		__m256i next = _mm256_loadu_si256((const __m256i *)(data + i + 1));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(here, newline), _mm256_cmpeq_epi8(next, period)));
+		if(mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	size_t rest = find_newline_period_sse2(data + i, size - i);
+	return i + rest;
+}
+#endif
+
+size_t (*find_newline_period)(const char *data, size_t size) = NULL;
+
+void setup_find_newline_period(void) {
+	// Pick the widest vector instructions the CPU has
+	find_newline_period = find_newline_period_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		find_newline_period = find_newline_period_avx2;
+	} else if(__builtin_cpu_supports("sse2")) {
+		find_newline_period = find_newline_period_sse2;
+	}
+#endif
+}
+
+size_t next_period_line(struct ring *ring, size_t offset, bool beginning_of_line) {
+	// Find the next line beginning with a period, at or after offset in the ring buffer
+	// Returns the offset of the period, or the amount of data if there is none
+	char first;
+	if(beginning_of_line && ring_peek(ring, offset, &first, 1) == 1 && first == '.') {
+		return offset;
+	}
+
+	struct iovec iov[2];
+	int iovcnt = ring_data_iov(ring, iov);
+	size_t base = 0;
+	for(int i = 0; i < iovcnt; i++) {
+		size_t length = iov[i].iov_len;
+		if(offset < base + length) {
+			size_t from = offset - base;
+			size_t found = from + find_newline_period((char *)iov[i].iov_base + from, length - from);
+			if(found < length) {
+				return base + found + 1;
+			}
+
+			// The \n may be the last byte before the data wraps around, with the period at the beginning of the ring buffer
+			char period;
+			if(((char *)iov[i].iov_base)[length - 1] == '\n' && ring_peek(ring, base + length, &period, 1) == 1 && period == '.') {
+				return base + length;
+			}
+		}
+		base += length;
+	}
+	return ring->fill;
+}
+
+int ring_slice_iov(struct ring *ring, size_t from, size_t to, struct iovec iov[2]) {
+	// Describe the data between two offsets, which may wrap around
+	size_t start = (ring->start + from) % ring->size;
+	size_t length = to - from;
+	size_t contiguous = ring->size - start < length ? ring->size - start : length;
+
+	iov[0].iov_base = ring->data + start;
+	iov[0].iov_len = contiguous;
+	iov[1].iov_base = ring->data;
+	iov[1].iov_len = length - contiguous;
+	return iov[1].iov_len != 0 ? 2 : 1;
+}
+
+ssize_t send_iov(int sock, struct iovec *iov, int iovcnt) {
+	struct msghdr message = {.msg_iov = iov, .msg_iovlen = iovcnt};
+	return sendmsg(sock, &message, MSG_NOSIGNAL);
+}
+
+void frame_append(struct connection *conn, const char *framing) {
+	// Add chunk framing to what's still to be sent ahead of the body
+	if(conn->frame_written == conn->frame_size) {
+		conn->frame_size = 0;
+		conn->frame_written = 0;
+	}
+
+	size_t length = strlen(framing);
+	memcpy(conn->frame + conn->frame_size, framing, length);
+	conn->frame_size += length;
+}
+
+void start_chunk(struct connection *conn, size_t size) {
+	char size_line[24];
+	snprintf(size_line, sizeof(size_line), "%zx\r\n", size);
+	frame_append(conn, size_line);
+	conn->chunk_left = size;
+}
+
+void chunk_sent(struct connection *conn, size_t amount) {
+	conn->chunk_left -= amount;
+	if(conn->chunk_left == 0) {
+		// The \r\n ending the chunk goes out along with whatever follows
+		frame_append(conn, "\r\n");
+	}
+}
+
+bool send_frame(struct connection *conn, int flags) {
+	// Send the framing that has to go before any more of the body
+	// Returns whether all of it is out, with errno set if not
+	while(conn->frame_written < conn->frame_size) {
+		ssize_t amount = send(conn->client.fd, conn->frame + conn->frame_written, conn->frame_size - conn->frame_written, MSG_NOSIGNAL | flags);
+		if(amount == -1) {
+			return false;
+		}
+		conn->frame_written += amount;
+		conn->bytes_sent += amount;
+	}
+	return true;
+}
+
+ssize_t send_framed(struct connection *conn, struct iovec *iov, int iovcnt) {
+	// Send part of the response body to the client as it is, framed as a chunk if the response is chunked
+	// Returns the amount of the body sent, not counting any framing
+	size_t total = 0;
+	for(int i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+	if(conn->prefetch) {
+		// Nobody to send it to, the body is only wanted for the cache and whoever joined the fetch
+		return total;
+	}
+
+	if(!conn->chunked) {
+		ssize_t amount = send_iov(conn->client.fd, iov, iovcnt);
+		if(amount > 0) {
+			conn->bytes_sent += amount;
+		}
+		return amount;
+	}
+
+	if(total == 0) {
+		return 0;
+	}
+	if(conn->chunk_left == 0) {
+		start_chunk(conn, total);
+	}
+
+	// Framing first, then no more of the body than is left of the chunk
+	struct iovec framed[TEXT_IOV_MAX + 1];
+	int framedcnt = 0;
+	size_t frame_left = conn->frame_size - conn->frame_written;
+	if(frame_left > 0) {
+		framed[framedcnt].iov_base = conn->frame + conn->frame_written;
+		framed[framedcnt].iov_len = frame_left;
+		framedcnt++;
+	}
+	size_t room = conn->chunk_left;
+	for(int i = 0; i < iovcnt && room > 0; i++) {
+		framed[framedcnt] = iov[i];
+		if(framed[framedcnt].iov_len > room) {
+			framed[framedcnt].iov_len = room;
+		}
+		room -= framed[framedcnt].iov_len;
+		framedcnt++;
+	}
+
+	ssize_t amount = send_iov(conn->client.fd, framed, framedcnt);
+	if(amount == -1) {
+		return -1;
+	}
+	conn->bytes_sent += amount;
+	if((size_t)amount <= frame_left) {
+		// Only framing went out, so the socket buffer is full
+		conn->frame_written += amount;
+		errno = EAGAIN;
+		return -1;
+	}
+
+	conn->frame_written = conn->frame_size;
+	chunk_sent(conn, amount - frame_left);
+	return amount - frame_left;
+}
+
+bool encoder_send(struct connection *conn, int flush) {
+	// Send the compressed body, after compressing whatever the encoder still holds back if flushing: Z_SYNC_FLUSH for everything so far, Z_FINISH for the end of the body
+	// Returns whether all of it is out, with errno set if not
+	struct encoder *encoder = conn->encoder;
+	for(;;) {
+		while(encoder->out_written < encoder->out_size) {
+			struct iovec iov = {.iov_base = encoder->out + encoder->out_written, .iov_len = encoder->out_size - encoder->out_written};
+			ssize_t amount = send_framed(conn, &iov, 1);
+			if(amount == -1) {
+				return false;
+			}
+			encoder->out_written += amount;
+		}
+		encoder->out_size = 0;
+		encoder->out_written = 0;
+
+		if(flush == Z_NO_FLUSH || encoder->finished || (flush == Z_SYNC_FLUSH && !encoder->unflushed)) {
+			return true;
+		}
+
+		z_stream *stream = &encoder->stream;
+		stream->next_in = NULL;
+		stream->avail_in = 0;
+		stream->next_out = (Bytef *)encoder->out;
+		stream->avail_out = ENCODER_OUT;
+		int result = deflate(stream, flush);
+		encoder->out_size = ENCODER_OUT - stream->avail_out;
+		if(result == Z_STREAM_END) {
+			encoder->finished = true;
+		} else if(flush == Z_SYNC_FLUSH && stream->avail_out > 0) {
+			encoder->unflushed = false;
+		}
+	}
+}
+
+ssize_t send_compressed(struct connection *conn, struct iovec *iov, int iovcnt) {
+	// Compress as much of the body as there's room for, and send whatever that gives along with what's left over from before
+	// The body taken in counts as sent, what it compresses into goes out on later calls if it can't all go now
+	struct encoder *encoder = conn->encoder;
+	if(!encoder_send(conn, Z_NO_FLUSH)) {
+		return -1;
+	}
+
+	z_stream *stream = &encoder->stream;
+	stream->next_out = (Bytef *)encoder->out;
+	stream->avail_out = ENCODER_OUT;
+	size_t taken = 0;
+	for(int i = 0; i < iovcnt && stream->avail_out > 0; i++) {
+		stream->next_in = iov[i].iov_base;
+		stream->avail_in = iov[i].iov_len;
+		deflate(stream, Z_NO_FLUSH);
+		taken += iov[i].iov_len - stream->avail_in;
+		if(stream->avail_in > 0) {
+			break;
+		}
+	}
+	encoder->out_size = ENCODER_OUT - stream->avail_out;
+	if(taken > 0) {
+		encoder->unflushed = true;
+	}
+
+	if(!encoder_send(conn, Z_NO_FLUSH) && !would_block()) {
+		return -1;
+	}
+	return taken;
+}
+
+ssize_t send_body(struct connection *conn, struct iovec *iov, int iovcnt) {
+	// Send part of the response body to the client, compressed if the client wants it that way and framed as a chunk if the response is chunked
+	// Returns the amount of the body sent, not counting any framing
+	if(conn->encoder != NULL) {
+		return send_compressed(conn, iov, iovcnt);
+	}
+	return send_framed(conn, iov, iovcnt);
+}
+
+ssize_t stream_encoded(struct connection *conn, int flush) {
+	// Send what's left of the compressed body, returning how much went out like stream_to_client()
+	unsigned long long int sent = conn->bytes_sent;
+	if(!encoder_send(conn, flush) && conn->bytes_sent == sent) {
+		return -1;
+	}
+	return conn->bytes_sent - sent;
+}
+
+void html_append(struct gophermap *map, const char *data, size_t size) {
+	if(map->html_size + size > map->html_allocated) {
+		size_t allocated = map->html_allocated > 0 ? map->html_allocated : 1024;
+		while(allocated < map->html_size + size) {
+			allocated *= 2;
+		}
+
+		char *html = realloc(map->html, allocated);
+		if(html == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		map->html = html;
+		map->html_allocated = allocated;
+	}
+
+	memcpy(map->html + map->html_size, data, size);
+	map->html_size += size;
+}
+
+void html_append_string(struct gophermap *map, const char *string) {
+	html_append(map, string, strlen(string));
+}
+
+void html_append_escaped(struct gophermap *map, const char *text, size_t size) {
+	// Append text, escaping what HTML would otherwise take as markup
+	size_t start = 0;
+	for(size_t i = 0; i < size; i++) {
+		const char *entity = NULL;
+		if(text[i] == '&') {
+			entity = "&amp;";
+		} else if(text[i] == '<') {
+			entity = "&lt;";
+		} else if(text[i] == '>') {
+			entity = "&gt;";
+		} else if(text[i] == '"') {
+			entity = "&quot;";
+		}
+
+		if(entity != NULL) {
+			html_append(map, text + start, i - start);
+			html_append_string(map, entity);
+			start = i + 1;
+		}
+	}
+	html_append(map, text + start, size - start);
+}
+
+void html_append_encoded(struct gophermap *map, const char *selector, size_t size) {
+	// Append a selector as part of an URL, percent-encoding everything that might not survive as it is
+	const char *hex = "0123456789ABCDEF";
+	for(size_t i = 0; i < size; i++) {
+		unsigned char c = selector[i];
+		if(isalnum(c) || (c != '\0' && strchr("-._~/:@!$'()*+,;=", c) != NULL)) {
+			html_append(map, (char *)&c, 1);
+		} else {
+			char encoded[3] = {'%', hex[c >> 4], hex[c & 0xf]};
+			html_append(map, encoded, sizeof(encoded));
+		}
+	}
+}
+
+void gophermap_setup(struct connection *conn) {
+	// The state of the translation stays with the connection for the next gophermap, along with the memory for the HTML
+	if(conn->gophermap_memory == NULL) {
+		conn->gophermap_memory = calloc(1, sizeof(struct gophermap));
+		if(conn->gophermap_memory == NULL) {
+			perror("calloc");
+			exit(1);
+		}
+	}
+	conn->gophermap = conn->gophermap_memory;
+	char *html = conn->gophermap->html;
+	size_t html_allocated = conn->gophermap->html_allocated;
+	memset(conn->gophermap, 0, sizeof(struct gophermap));
+	conn->gophermap->html = html;
+	conn->gophermap->html_allocated = html_allocated;
+
+	// Start off with everything up to where the menu goes, so the client has something to show right away
+	struct gophermap *map = conn->gophermap;
+	html_append_string(map, "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n<title>");
+	if(conn->path_size > 0) {
+		html_append_escaped(map, conn->path, conn->path_size);
+	} else {
+		html_append_escaped(map, backends[0].host, strlen(backends[0].host));
+	}
+	html_append_string(map, "</title>\n</head>\n<body>\n<pre>\n");
+}
+
+void gophermap_collect(struct gophermap *map, const char *data, size_t size) {
+	// Lines too long to fit are cut off rather than buffered, so memory use stays the same no matter what the remote sends
+	size_t room = GOPHERMAP_LINE_MAX - map->line_size;
+	if(size > room) {
+		size = room;
+		map->line_overflow = true;
+	}
+	memcpy(map->line + map->line_size, data, size);
+	map->line_size += size;
+}
+
+void gophermap_finish(struct gophermap *map) {
+	html_append_string(map, "</pre>\n</body>\n</html>\n");
+	map->finished = true;
+}
+
+bool linkable_url(const char *url, size_t size) {
+	// Only schemes that just lead somewhere else, not ones like javascript: or data: that would run or show whatever the gophermap has in them as if it came from us
+	const char *schemes[] = {"http:", "https:", "gopher:", "ftp:", "mailto:"};
+	for(size_t i = 0; i < sizeof(schemes) / sizeof(*schemes); i++) {
+		size_t length = strlen(schemes[i]);
+		if(size > length && strncasecmp(url, schemes[i], length) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void gophermap_translate(struct connection *conn) {
+	// Translate the collected line into HTML: itemtype, display string, then selector, host and port separated by tabs
+	struct gophermap *map = conn->gophermap;
+	char *line = map->line;
+	size_t line_size = map->line_size;
+	bool cut_off = map->line_overflow;
+	map->line_size = 0;
+	map->line_overflow = false;
+
+	if(line_size > 0 && line[line_size - 1] == '\r') {
+		line_size--;
+	}
+
+	if(line_size == 1 && line[0] == '.') {
+		// End of the listing, discard the rest
+		conn->remote_eof = true;
+		ring_consume(&conn->ring, conn->ring.fill);
+		return;
+	}
+
+	if(line_size == 0) {
+		html_append_string(map, "\n");
+		return;
+	}
+
+	char itemtype = line[0];
+	const char *fields[4] = {"", "", "", ""};
+	size_t field_sizes[4] = {0, 0, 0, 0};
+	const char *field = line + 1;
+	const char *end = line + line_size;
+	for(size_t i = 0; i < 4 && field <= end; i++) {
+		const char *tab = memchr(field, '\t', end - field);
+		fields[i] = field;
+		field_sizes[i] = (tab != NULL ? tab : end) - field;
+		if(tab == NULL) {
+			break;
+		}
+		field = tab + 1;
+	}
+	const char *display = fields[0], *selector = fields[1], *host = fields[2], *port = fields[3];
+	size_t display_size = field_sizes[0], selector_size = field_sizes[1], host_size = field_sizes[2], port_size = field_sizes[3];
+
+	// Items on the backends we're proxying are linked to through us, other gopher servers directly
+	char port_string[8];
+	snprintf(port_string, sizeof(port_string), "%.*s", (int)(port_size < 7 ? port_size : 7), port);
+	bool local = false;
+	for(size_t i = 0; i < number_backends && !local; i++) {
+		local = host_size == strlen(backends[i].host) && strncasecmp(host, backends[i].host, host_size) == 0 && strtol(port_string, NULL, 10) == backends[i].port;
+	}
+
+	if(itemtype == 'i' || itemtype == '3') { // Informational message, error
+		html_append_escaped(map, display, display_size);
+	} else if(itemtype == 'h' && selector_size > 4 && memcmp(selector, "URL:", 4) == 0 && !linkable_url(selector + 4, selector_size - 4)) { // Link to an URL we won't link to
+		html_append_escaped(map, display, display_size);
+	} else if(itemtype == 'h' && selector_size > 4 && memcmp(selector, "URL:", 4) == 0) { // Link to an URL elsewhere
+		html_append_string(map, "<a href=\"");
+		html_append_escaped(map, selector + 4, selector_size - 4);
+		html_append_string(map, "\">");
+		html_append_escaped(map, display, display_size);
+		html_append_string(map, "</a>");
+	} else if(local && recognised_itemtype(itemtype)) {
+		html_append_string(map, "<a href=\"/");
+		html_append(map, &itemtype, 1);
+		html_append_encoded(map, selector, selector_size);
+		html_append_string(map, "\">");
+		html_append_escaped(map, display, display_size);
+		html_append_string(map, "</a>");
+
+		// The links of a gophermap a client asked for are likely to be followed next, but not those of one being prefetched
+		if(!conn->prefetch && !cut_off) {
+			prefetch_queue(map, itemtype, selector, selector_size);
+		}
+	} else if(!local && host_size > 0 && itemtype != '8' && itemtype != 'T') { // Not telnet sessions, those aren't gopher
+		html_append_string(map, "<a href=\"gopher://");
+		html_append_escaped(map, host, host_size);
+		html_append_string(map, ":");
+		html_append_escaped(map, port, port_size);
+		html_append_string(map, "/");
+		html_append(map, &itemtype, 1);
+		html_append_encoded(map, selector, selector_size);
+		html_append_string(map, "\">");
+		html_append_escaped(map, display, display_size);
+		html_append_string(map, "</a>");
+	} else {
+		// Nothing we can link to
+		html_append_escaped(map, display, display_size);
+	}
+	html_append_string(map, "\n");
+}
+
+size_t body_fill(struct connection *conn) {
+	if(conn->pipe_pair.read_fd != -1) {
+		return conn->pipe_fill;
+	}
+
+	// A gophermap isn't done until its translation has been written out too, and the footer still needs adding until it's finished
+	if(conn->gophermap != NULL) {
+		struct gophermap *map = conn->gophermap;
+		return conn->ring.fill + (map->html_size - map->html_written) + !map->finished;
+	}
+
+	return conn->ring.fill;
+}
+
+size_t stream_fill(struct connection *conn) {
+	// A compressed body isn't done until the compressed output has been sent too, and its end still needs producing until it's finished
+	if(conn->encoder != NULL) {
+		struct encoder *encoder = conn->encoder;
+		return body_fill(conn) + (encoder->out_size - encoder->out_written) + !encoder->finished;
+	}
+
+	return body_fill(conn);
+}
+
+void remote_received(struct connection *conn) {
+	// Time to first byte counts from the request being received to the first of the body arriving from the remote
+	if(!conn->first_byte) {
+		conn->first_byte = true;
+		conn->first_byte_latency = monotonic_us() - conn->request_start;
+		histogram_observe(&metrics->first_byte_duration, conn->first_byte_latency);
+		histogram_observe(&metrics->backend_first_byte_duration[conn->backend - backends], conn->first_byte_latency);
+	}
+}
+
+ssize_t stream_from_remote(struct connection *conn) {
+	// Read data from the remote into the pipe or the ring buffer
+	// Returns the amount of data read, 0 on EOF or -1 on error
+	if(conn->pipe_pair.read_fd != -1) {
+		ssize_t amount = splice(conn->remote.fd, NULL, conn->pipe_pair.write_fd, NULL, conn->pipe_pair.size - conn->pipe_fill, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if(amount == -1 && (errno == EINVAL || errno == ENOSYS) && conn->pipe_fill == 0) {
+			// Can't splice from this socket, fall back to copying through the ring buffer from now on
+			log_error("%s: splice not supported, falling back to copying\n", program_name);
+			use_splice = false;
+			put_pipe(&conn->pipe_pair, true);
+			ring_setup(&conn->ring, conn->ring_memory, ring_size);
+		} else {
+			if(amount > 0) {
+				conn->pipe_fill += amount;
+				remote_received(conn);
+				TRACE3(remote_receive, conn->id, amount, conn->pipe_fill);
+			}
+			return amount;
+		}
+	}
+
+	struct iovec iov[2];
+	int iovcnt = ring_free_iov(&conn->ring, iov);
+	ssize_t amount = readv(conn->remote.fd, iov, iovcnt);
+	if(amount > 0) {
+		conn->ring.fill += amount;
+		remote_received(conn);
+		TRACE3(remote_receive, conn->id, amount, conn->ring.fill);
+	}
+	return amount;
+}
+
+ssize_t stream_to_client(struct connection *conn) {
+	// Write data from the ring buffer to the client
+	// Returns the amount of data consumed from the buffer, 0 if nothing can be written until more data arrives, or -1 on error
+	if(conn->encoder != NULL) {
+		// Compressed output left over from before goes first, and once the whole body has gone in all that's left is the end of it
+		struct encoder *encoder = conn->encoder;
+		bool end = conn->remote_eof && body_fill(conn) == 0;
+		if(encoder->out_written < encoder->out_size || end) {
+			return stream_encoded(conn, end ? Z_FINISH : Z_NO_FLUSH);
+		}
+	}
+
+	if(conn->copymode == BINARY && conn->pipe_pair.read_fd != -1) {
+		// Framing can't be spliced, so it gets sent on its own, telling the kernel more follows
+		if(conn->chunked) {
+			if(conn->chunk_left == 0) {
+				start_chunk(conn, conn->pipe_fill);
+			}
+			if(!send_frame(conn, MSG_MORE)) {
+				return -1;
+			}
+		}
+
+		ssize_t amount = splice(conn->pipe_pair.read_fd, NULL, conn->client.fd, NULL, conn->chunked ? conn->chunk_left : conn->pipe_fill, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(amount > 0) {
+			conn->pipe_fill -= amount;
+			conn->bytes_sent += amount;
+			if(conn->chunked) {
+				chunk_sent(conn, amount);
+			}
+		}
+		return amount;
+	} else if(conn->copymode == BINARY) {
+		struct iovec iov[2];
+		int iovcnt = ring_data_iov(&conn->ring, iov);
+		ssize_t amount = send_body(conn, iov, iovcnt);
+		if(amount > 0) {
+			size_t first = (size_t)amount < iov[0].iov_len ? (size_t)amount : iov[0].iov_len;
+			capture(conn, iov[0].iov_base, first);
+			capture(conn, iov[1].iov_base, amount - first);
+			ring_consume(&conn->ring, amount);
+		}
+		return amount;
+	} else if(conn->copymode == TEXT) {
+		// Send everything in the ring buffer at once, in pieces that leave out the periods doubled at the beginning of lines
+		// Only lines beginning with a period need looking at, and those are found in one pass
+		struct iovec iov[TEXT_IOV_MAX];
+		size_t offsets[TEXT_IOV_MAX];
+		int iovcnt = 0;
+		size_t offset = 0;
+		bool beginning_of_line = conn->beginning_of_line;
+		bool terminated = false;
+
+		while(offset < conn->ring.fill && iovcnt + 2 <= TEXT_IOV_MAX) {
+			size_t period = next_period_line(&conn->ring, offset, beginning_of_line);
+
+			// Everything up to the line beginning with a period goes out as it is
+			if(period > offset) {
+				int added = ring_slice_iov(&conn->ring, offset, period, iov + iovcnt);
+				offsets[iovcnt] = offset;
+				if(added == 2) {
+					offsets[iovcnt + 1] = offset + iov[iovcnt].iov_len;
+				}
+				iovcnt += added;
+			}
+			if(period == conn->ring.fill) {
+				offset = period;
+				break;
+			}
+
+			char peek[3];
+			size_t peeked = ring_peek(&conn->ring, period, peek, sizeof(peek));
+			if(peeked >= 2 && memcmp(peek, "..", 2) == 0) {
+				// Remove the double period in the beginning of line
+				offset = period + 1;
+			} else if(peeked == 3 && memcmp(peek, ".\r\n", 3) == 0) {
+				// End of the response, once everything before it is out
+				offset = period;
+				terminated = true;
+				break;
+			} else if(peeked < 3 && memcmp(peek, ".\r\n", peeked) == 0 && !conn->remote_eof) {
+				// Might be either, wait for the rest of the line
+				offset = period;
+				break;
+			} else {
+				// Just a period
+				offset = period;
+			}
+			beginning_of_line = false;
+		}
+
+		if(iovcnt == 0) {
+			if(terminated) {
+				// Discard the rest
+				conn->remote_eof = true;
+				ring_consume(&conn->ring, conn->ring.fill);
+				return 3;
+			}
+
+			// Nothing to send but maybe a removed period
+			ring_consume(&conn->ring, offset);
+			if(offset > 0) {
+				conn->beginning_of_line = false;
+			}
+			return offset;
+		}
+
+		ssize_t amount = send_body(conn, iov, iovcnt);
+		if(amount == -1) {
+			return -1;
+		}
+
+		// The send may have been partial, so work out how far into the ring buffer it got, and where we are in the line
+		size_t left = amount;
+		size_t consumed = 0;
+		for(int i = 0; i < iovcnt && left > 0; i++) {
+			size_t sent = left < iov[i].iov_len ? left : iov[i].iov_len;
+			capture(conn, iov[i].iov_base, sent);
+			consumed = offsets[i] + sent;
+			conn->beginning_of_line = ((char *)iov[i].iov_base)[sent - 1] == '\n';
+			left -= sent;
+		}
+
+		if(terminated && consumed == offsets[iovcnt - 1] + iov[iovcnt - 1].iov_len) {
+			// Everything before the end of the response is out, discard the rest
+			conn->remote_eof = true;
+			consumed = conn->ring.fill;
+		}
+		ring_consume(&conn->ring, consumed);
+		return consumed;
+	} else if(conn->copymode == GOPHERMAP) {
+		struct gophermap *map = conn->gophermap;
+		size_t consumed = 0;
+
+		// Once everything translated so far is out, translate the next line
+		// It's collected as it comes in, so only the part that hasn't arrived yet is left in the ring buffer
+		if(map->html_written == map->html_size && !map->finished) {
+			map->html_size = 0;
+			map->html_written = 0;
+
+			bool complete = false;
+			while(conn->ring.fill > 0 && !complete) {
+				struct iovec iov[2];
+				ring_data_iov(&conn->ring, iov);
+				char *start = iov[0].iov_base;
+				char *end = memchr(start, '\n', iov[0].iov_len);
+				size_t length = end == NULL ? iov[0].iov_len : (size_t)(end - start + 1);
+
+				gophermap_collect(map, start, end == NULL ? length : length - 1);
+				ring_consume(&conn->ring, length);
+				consumed += length;
+				complete = end != NULL;
+			}
+
+			// A last line without a \n still counts
+			if(complete || (conn->remote_eof && conn->ring.fill == 0 && map->line_size > 0)) {
+				gophermap_translate(conn);
+			}
+
+			if(conn->remote_eof && conn->ring.fill == 0) {
+				gophermap_finish(map);
+			}
+		}
+
+		if(map->html_written == map->html_size) {
+			return consumed;
+		}
+
+		struct iovec iov = {.iov_base = map->html + map->html_written, .iov_len = map->html_size - map->html_written};
+		ssize_t amount = send_body(conn, &iov, 1);
+		if(amount == -1) {
+			return consumed > 0 ? (ssize_t)consumed : -1;
+		}
+		capture(conn, map->html + map->html_written, amount);
+		map->html_written += amount;
+		return consumed + amount;
+	} else {
+		log_error("%s: Illegal value of conn->copymode: %i", program_name, conn->copymode);
+		exit(1);
+	}
+}
+
+bool slice_equals(struct slice slice, const char *string) {
+	return slice.size == strlen(string) && memcmp(slice.data, string, slice.size) == 0;
+}
+
+enum parse_result parse_request(struct request *request, char *data, size_t size) {
+	// Parse the complete lines that have arrived since the last call, in place
+	// Request line first, then header lines up to an empty line, keeping note of the parts we care about
+	while(request->parsed < size) {
+		char *line = data + request->parsed;
+		char *newline = memchr(line, '\n', size - request->parsed);
+		if(newline == NULL) {
+			return PARSE_INCOMPLETE;
+		}
+		request->parsed = newline - data + 1;
+
+		size_t line_size = newline - line;
+		if(line_size > 0 && line[line_size - 1] == '\r') {
+			line_size--;
+		}
+		char *end = line + line_size;
+
+		if(request->method.data == NULL) {
+			// Empty lines before the request line are allowed, e.g. left over after a previous request
+			if(line_size == 0) {
+				continue;
+			}
+
+			// Method, target and version separated by spaces
+			char *space = memchr(line, ' ', line_size);
+			char *target = space + 1;
+			char *second_space = space != NULL ? memchr(target, ' ', end - target) : NULL;
+			if(second_space == NULL || space == line || second_space == target) {
+				return PARSE_ERROR;
+			}
+			request->method = (struct slice){line, space - line};
+			request->target = (struct slice){target, second_space - target};
+			request->version = (struct slice){second_space + 1, end - (second_space + 1)};
+			continue;
+		}
+
+		if(line_size == 0) {
+			request->size = request->parsed;
+			return PARSE_DONE;
+		}
+
+		// Header name, colon, and the value without the whitespace around it
+		char *colon = memchr(line, ':', line_size);
+		if(colon == NULL || colon == line) {
+			return PARSE_ERROR;
+		}
+		char *value = colon + 1;
+		while(value < end && (*value == ' ' || *value == '\t')) {
+			value++;
+		}
+		char *value_end = end;
+		while(value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+			value_end--;
+		}
+
+		size_t name_size = colon - line;
+		for(size_t i = 0; i < sizeof(request_headers) / sizeof(*request_headers); i++) {
+			if(strlen(request_headers[i].name) == name_size && strncasecmp(line, request_headers[i].name, name_size) == 0) {
+				*(struct slice *)((char *)request + request_headers[i].offset) = (struct slice){value, value_end - value};
+				break;
+			}
+		}
+	}
+
+	return PARSE_INCOMPLETE;
+}
+
+int hex_value(char c) {
+	return isdigit((unsigned char)c) ? c - '0' : tolower((unsigned char)c) - 'a' + 10;
+}
+
+size_t percent_decode(char *data, size_t size) {
+	// Decode %XX escapes in place, returning the new size, and leave anything that isn't a valid escape as it is
+	size_t decoded = 0;
+	for(size_t i = 0; i < size; i++) {
+		if(data[i] == '%' && i + 2 < size && isxdigit((unsigned char)data[i + 1]) && isxdigit((unsigned char)data[i + 2])) {
+			data[decoded++] = hex_value(data[i + 1]) << 4 | hex_value(data[i + 2]);
+			i += 2;
+		} else {
+			data[decoded++] = data[i];
+		}
+	}
+	return decoded;
+}
+
+void write_histogram_series(FILE *stream, const char *name, const char *labels, size_t offset) {
+	// Buckets are cumulative, and durations in seconds
+	struct histogram total = {0};
+	for(size_t i = 0; i < number_metrics; i++) {
+		struct histogram *histogram = (struct histogram *)((char *)&all_metrics[i] + offset);
+		for(size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+			total.buckets[bucket] += histogram->buckets[bucket];
+		}
+		total.count += histogram->count;
+		total.sum += histogram->sum;
+	}
+
+	const char *separator = labels[0] != '\0' ? "," : "";
+	const char *open = labels[0] != '\0' ? "{" : "";
+	const char *close = labels[0] != '\0' ? "}" : "";
+	unsigned long long int cumulative = 0;
+	for(size_t bucket = 0; bucket < HISTOGRAM_BUCKETS - 1; bucket++) {
+		cumulative += total.buckets[bucket];
+		fprintf(stream, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, separator, histogram_bounds[bucket] / 1e6, cumulative);
+	}
+	fprintf(stream, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, separator, total.count);
+	fprintf(stream, "%s_sum%s%s%s %.6f\n%s_count%s%s%s %llu\n", name, open, labels, close, total.sum / 1e6, name, open, labels, close, total.count);
+}
+
+void write_histogram(FILE *stream, const char *name, const char *help, size_t offset) {
+	fprintf(stream, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	write_histogram_series(stream, name, "", offset);
+}
+
+void write_backend_values(FILE *stream, const char *name, const char *type, const char *help, size_t offset) {
+	// One per backend, each an array in the metrics indexed by backend
+	fprintf(stream, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+	for(size_t backend = 0; backend < number_backends; backend++) {
+		long long int total = 0;
+		for(size_t i = 0; i < number_metrics; i++) {
+			total += ((long long int *)((char *)&all_metrics[i] + offset))[backend];
+		}
+		fprintf(stream, "%s{backend=\"%s\"} %lld\n", name, backends[backend].name, total);
+	}
+}
+
+void write_backend_histograms(FILE *stream, const char *name, const char *help, size_t offset) {
+	fprintf(stream, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	for(size_t backend = 0; backend < number_backends; backend++) {
+		char labels[sizeof(backends[backend].name) + 16];
+		snprintf(labels, sizeof(labels), "backend=\"%s\"", backends[backend].name);
+		write_histogram_series(stream, name, labels, offset + backend * sizeof(struct histogram));
+	}
+}
+
+void write_counter(FILE *stream, const char *name, const char *type, const char *help, size_t offset) {
+	unsigned long long int total = 0;
+	for(size_t i = 0; i < number_metrics; i++) {
+		total += *(unsigned long long int *)((char *)&all_metrics[i] + offset);
+	}
+	fprintf(stream, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name, total);
+}
+
+void write_metrics(FILE *stream) {
+	// Prometheus text format, adding up the metrics of all workers
+	fprintf(stream, "# HELP idigna_connections Client connections open, by the state they are in.\n# TYPE idigna_connections gauge\n");
+	for(size_t state = 0; state < NUMBER_STATES; state++) {
+		long long int total = 0;
+		for(size_t i = 0; i < number_metrics; i++) {
+			total += all_metrics[i].connections[state];
+		}
+		fprintf(stream, "idigna_connections{state=\"%s\"} %lld\n", state_names[state], total);
+	}
+
+	write_counter(stream, "idigna_accepted_connections_total", "counter", "Client connections accepted.", offsetof(struct metrics, accepted));
+	write_counter(stream, "idigna_requests_total", "counter", "Requests received.", offsetof(struct metrics, requests));
+	write_histogram(stream, "idigna_connect_duration_seconds", "Time from a request needing the remote to being connected to it, including waiting for addresses.", offsetof(struct metrics, connect_duration));
+	write_histogram(stream, "idigna_first_byte_duration_seconds", "Time from a request being received to the first byte of the response arriving from the remote.", offsetof(struct metrics, first_byte_duration));
+	write_histogram(stream, "idigna_request_duration_seconds", "Time from a request being received to being done with it.", offsetof(struct metrics, request_duration));
+
+	// Itemtypes come from clients, so anything that can't go in a label as it is gets counted together
+	fprintf(stream, "# HELP idigna_sent_bytes_total Bytes sent to clients, by itemtype.\n# TYPE idigna_sent_bytes_total counter\n");
+	unsigned long long int other_bytes = 0;
+	for(int itemtype = 0; itemtype < 256; itemtype++) {
+		unsigned long long int total = 0;
+		for(size_t i = 0; i < number_metrics; i++) {
+			total += all_metrics[i].sent_bytes[itemtype];
+		}
+		if(!isgraph(itemtype) || itemtype == '"' || itemtype == '\\') {
+			other_bytes += total;
+		} else if(total > 0) {
+			fprintf(stream, "idigna_sent_bytes_total{itemtype=\"%c\"} %llu\n", itemtype, total);
+		}
+	}
+	fprintf(stream, "idigna_sent_bytes_total{itemtype=\"other\"} %llu\n", other_bytes);
+
+	fprintf(stream, "# HELP idigna_errors_total Requests that failed, by cause.\n# TYPE idigna_errors_total counter\n");
+	for(size_t cause = 0; cause < NUMBER_ERROR_CAUSES; cause++) {
+		unsigned long long int total = 0;
+		for(size_t i = 0; i < number_metrics; i++) {
+			total += all_metrics[i].errors[cause];
+		}
+		fprintf(stream, "idigna_errors_total{cause=\"%s\"} %llu\n", error_causes[cause].name, total);
+	}
+
+	// Misses of the memory cache go on to the disk cache if there is one, so only the misses of the last cache tried count
+	unsigned long long int hits = 0, misses = 0;
+	for(size_t i = 0; i < number_metrics; i++) {
+		hits += all_metrics[i].cache_hits + all_metrics[i].disk_cache_hits;
+		misses += disk_cache_root != NULL ? all_metrics[i].disk_cache_misses : all_metrics[i].cache_misses;
+	}
+	fprintf(stream, "# HELP idigna_cache_hit_ratio Share of lookups in the cache answered from memory or disk.\n# TYPE idigna_cache_hit_ratio gauge\nidigna_cache_hit_ratio %g\n", hits + misses > 0 ? (double)hits / (hits + misses) : 0.0);
+	write_counter(stream, "idigna_cache_hits_total", "counter", "Responses served from the memory cache.", offsetof(struct metrics, cache_hits));
+	write_counter(stream, "idigna_cache_misses_total", "counter", "Lookups in the memory cache that found nothing.", offsetof(struct metrics, cache_misses));
+	write_counter(stream, "idigna_cache_stores_total", "counter", "Responses stored in the memory cache.", offsetof(struct metrics, cache_stores));
+	write_counter(stream, "idigna_cache_evictions_total", "counter", "Responses evicted from the memory cache.", offsetof(struct metrics, cache_evictions));
+	write_counter(stream, "idigna_cache_objects", "gauge", "Responses in the memory cache.", offsetof(struct metrics, cache_objects));
+	write_counter(stream, "idigna_cache_bytes", "gauge", "Bytes used by the memory cache.", offsetof(struct metrics, cache_bytes));
+	write_counter(stream, "idigna_disk_cache_hits_total", "counter", "Responses served from the disk cache.", offsetof(struct metrics, disk_cache_hits));
+	write_counter(stream, "idigna_disk_cache_misses_total", "counter", "Lookups in the disk cache that found nothing.", offsetof(struct metrics, disk_cache_misses));
+	write_counter(stream, "idigna_disk_cache_stores_total", "counter", "Responses stored in the disk cache.", offsetof(struct metrics, disk_cache_stores));
+	write_counter(stream, "idigna_disk_cache_evictions_total", "counter", "Responses evicted from the disk cache.", offsetof(struct metrics, disk_cache_evictions));
+	write_counter(stream, "idigna_disk_cache_bytes", "gauge", "Bytes used by the disk cache.", offsetof(struct metrics, disk_cache_bytes));
+	fprintf(stream, "# HELP idigna_timeouts_total Connections that timed out, by what they were waiting for.\n# TYPE idigna_timeouts_total counter\n");
+	for(size_t timeout = HEADER_TIMEOUT; timeout < NUMBER_TIMEOUTS; timeout++) {
+		unsigned long long int total = 0;
+		for(size_t i = 0; i < number_metrics; i++) {
+			total += all_metrics[i].timeouts[timeout];
+		}
+		fprintf(stream, "idigna_timeouts_total{timeout=\"%s\"} %llu\n", timeout_names[timeout], total);
+	}
+
+	write_counter(stream, "idigna_access_log_dropped_total", "counter", "Access log lines dropped because the writer fell behind.", offsetof(struct metrics, access_log_dropped));
+	write_counter(stream, "idigna_joined_fetches_total", "counter", "Requests that joined a fetch of the same item already in progress.", offsetof(struct metrics, joined_flights));
+	write_counter(stream, "idigna_prefetches_total", "counter", "Items linked from gophermaps fetched ahead of being asked for.", offsetof(struct metrics, prefetches));
+	write_counter(stream, "idigna_prefetch_stored_total", "counter", "Prefetched items stored in the cache.", offsetof(struct metrics, prefetch_stored));
+	write_counter(stream, "idigna_prefetch_hits_total", "counter", "Requests answered by a prefetch, from the cache or by joining it.", offsetof(struct metrics, prefetch_hits));
+
+	write_backend_values(stream, "idigna_backend_connections", "gauge", "Requests in progress on each backend.", offsetof(struct metrics, backend_connections));
+	write_backend_values(stream, "idigna_backend_requests_total", "counter", "Requests passed on to each backend.", offsetof(struct metrics, backend_requests));
+	write_backend_values(stream, "idigna_backend_failures_total", "counter", "Connects to and health probes of each backend that failed.", offsetof(struct metrics, backend_failures));
+	write_backend_values(stream, "idigna_backend_ejected", "gauge", "Workers that have ejected each backend for failing.", offsetof(struct metrics, backend_ejected));
+	write_backend_histograms(stream, "idigna_backend_connect_duration_seconds", "Time taken to connect to each backend.", offsetof(struct metrics, backend_connect_duration));
+	write_backend_histograms(stream, "idigna_backend_first_byte_duration_seconds", "Time from a request being received to the first byte of the response arriving from each backend.", offsetof(struct metrics, backend_first_byte_duration));
+}
+
+void publish_metrics(void) {
+	// Statistics the caches and flights keep for themselves, copied where the other workers can see them
+	metrics->cache_hits = cache.hits;
+	metrics->cache_misses = cache.misses;
+	metrics->cache_stores = cache.stores;
+	metrics->cache_evictions = cache.evictions;
+	metrics->cache_objects = cache.number_entries;
+	metrics->cache_bytes = cache.bytes;
+	metrics->disk_cache_hits = disk_cache.hits;
+	metrics->disk_cache_misses = disk_cache.misses;
+	metrics->disk_cache_stores = disk_cache.stores;
+	metrics->disk_cache_evictions = disk_cache.evictions;
+	metrics->disk_cache_bytes = disk_cache.index != NULL ? disk_cache.index->bytes : 0;
+	metrics->joined_flights = joined_flights;
+}
+
+void serve_metrics(struct connection *conn) {
+	publish_metrics();
+
+	FILE *stream = open_memstream(&conn->response_body, &conn->response_body_size);
+	if(stream == NULL) {
+		perror("open_memstream");
+		exit(1);
+	}
+	write_metrics(stream);
+	if(fclose(stream) != 0) {
+		perror("fclose");
+		exit(1);
+	}
+
+	response_header(conn, "text/plain; version=0.0.4; charset=utf-8", conn->response_body_size);
+}
+
+bool etag_listed(struct slice header, const char *etag) {
+	// Whether If-None-Match lists the ETag, comparing weakly, i.e. ignoring W/
+	const char *end = header.data + header.size;
+	const char *tag = header.data;
+	size_t etag_size = strlen(etag);
+	while(tag < end) {
+		const char *comma = memchr(tag, ',', end - tag);
+		const char *tag_end = comma != NULL ? comma : end;
+		while(tag < tag_end && (*tag == ' ' || *tag == '\t')) {
+			tag++;
+		}
+		while(tag_end > tag && (tag_end[-1] == ' ' || tag_end[-1] == '\t')) {
+			tag_end--;
+		}
+		if(tag_end - tag >= 2 && memcmp(tag, "W/", 2) == 0) {
+			tag += 2;
+		}
+
+		if((tag_end - tag == 1 && *tag == '*') || ((size_t)(tag_end - tag) == etag_size && memcmp(tag, etag, etag_size) == 0)) {
+			return true;
+		}
+		tag = comma != NULL ? comma + 1 : end;
+	}
+	return false;
+}
+
+bool parse_http_date(struct slice slice, time_t *time) {
+	// Only the preferred format of HTTP dates, as every client still around sends it
+	char string[40];
+	if(slice.size >= sizeof(string)) {
+		return false;
+	}
+	memcpy(string, slice.data, slice.size);
+	string[slice.size] = '\0';
+
+	struct tm tm = {0};
+	const char *end = strptime(string, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if(end == NULL || *end != '\0') {
+		return false;
+	}
+	*time = timegm(&tm);
+	return true;
+}
+
+bool not_modified(struct connection *conn) {
+	// Whether the client already has the body, going by If-None-Match or, failing that, If-Modified-Since
+	struct request *request = &conn->request;
+	if(request->if_none_match.data != NULL) {
+		char etag[48];
+		format_etag(conn, etag, sizeof(etag));
+		return etag_listed(request->if_none_match, etag);
+	}
+
+	time_t since;
+	if(request->if_modified_since.data != NULL && parse_http_date(request->if_modified_since, &since)) {
+		return conn->modified <= since;
+	}
+	return false;
+}
+
+bool parse_digits(const char **position, const char *end, long long int *value) {
+	// Returns whether there were any, values too large to fit being as large as fits
+	const char *start = *position;
+	*value = 0;
+	for(; *position < end && isdigit((unsigned char)**position); (*position)++) {
+		int digit = **position - '0';
+		*value = *value > (LLONG_MAX - digit) / 10 ? LLONG_MAX : *value * 10 + digit;
+	}
+	return *position > start;
+}
+
+bool range_applies(struct connection *conn) {
+	// If-Range only lets the range through if the body is still what the client got the beginning of, compared strongly
+	struct slice if_range = conn->request.if_range;
+	if(if_range.data == NULL) {
+		return true;
+	}
+
+	char validator[48];
+	if(if_range.size > 0 && if_range.data[0] == '"') {
+		format_etag(conn, validator, sizeof(validator));
+	} else {
+		format_http_date(conn->modified, validator, sizeof(validator));
+	}
+	return slice_equals(if_range, validator);
+}
+
+int apply_range(struct connection *conn, off_t size) {
+	// Pick the part of the body to send going by Range:, returning the status to send it with
+	// Only a single range of bytes is served, anything else gets the whole body as if there was no Range: at all
+	conn->range_start = 0;
+	conn->range_end = size;
+
+	struct slice header = conn->request.range;
+	if(header.data == NULL || conn->head || header.size < 6 || strncasecmp(header.data, "bytes=", 6) != 0 || memchr(header.data, ',', header.size) != NULL || !range_applies(conn)) {
+		return 200;
+	}
+
+	const char *position = header.data + 6;
+	const char *end = header.data + header.size;
+	long long int first, last;
+	while(position < end && *position == ' ') {
+		position++;
+	}
+	bool has_first = parse_digits(&position, end, &first);
+	if(position == end || *position != '-') {
+		return 200;
+	}
+	position++;
+	bool has_last = parse_digits(&position, end, &last);
+	while(position < end && *position == ' ') {
+		position++;
+	}
+	if(position != end || (!has_first && !has_last) || (has_first && has_last && last < first)) {
+		return 200;
+	}
+
+	if(!has_first) {
+		// The last so many bytes
+		if(last == 0 || size == 0) {
+			return 416;
+		}
+		conn->range_start = last < size ? size - last : 0;
+	} else {
+		if(first >= size) {
+			return 416;
+		}
+		conn->range_start = first;
+		if(has_last && last < size - 1) {
+			conn->range_end = last + 1;
+		}
+	}
+	return 206;
+}
+
+bool known_response(struct connection *conn, off_t size) {
+	// Put the header of a body known up front in the buffer, answering conditional requests and ranges
+	// Returns whether any of the body is to be sent, otherwise the response is only the header and is on its way
+	const char *mimetype = get_mimetype(conn->itemtype, conn->path, conn->path_size);
+
+	if(not_modified(conn)) {
+		conn->status = 304;
+		response_header(conn, mimetype, size);
+		set_state(conn, RESPONSE_WRITE);
+		return false;
+	}
+
+	conn->status = apply_range(conn, size);
+	if(conn->status == 416) {
+		conn->range_end = 0;
+		response_header(conn, mimetype, size);
+		set_state(conn, RESPONSE_WRITE);
+		return false;
+	}
+
+	response_header(conn, mimetype, size);
+	return true;
+}
+
+void connection_header(struct connection *conn, const char *value, size_t value_size) {
+	// Connection: takes a list of options, of which close and keep-alive override the default of the HTTP version
+	const char *end = value + value_size;
+	while(value < end) {
+		const char *comma = memchr(value, ',', end - value);
+		const char *option_end = comma != NULL ? comma : end;
+		while(value < option_end && (*value == ' ' || *value == '\t')) {
+			value++;
+		}
+		size_t option_size = option_end - value;
+		while(option_size > 0 && (value[option_size - 1] == ' ' || value[option_size - 1] == '\t')) {
+			option_size--;
+		}
+
+		if(option_size == 5 && strncasecmp(value, "close", 5) == 0) {
+			conn->keep_alive = false;
+		} else if(option_size == 10 && strncasecmp(value, "keep-alive", 10) == 0) {
+			conn->keep_alive = true;
+		}
+		value = option_end + 1;
+	}
+}
+
+void handle_connection(struct connection *conn) {
+	// Sockets are non-blocking and (with epoll) edge-triggered, so keep going until we would block
+	for(;;) {
+		if(conn->state == START) {
+			// Parse as much of the request as has arrived
+			enum parse_result result = parse_request(&conn->request, conn->request_buffer, conn->request_size);
+
+			if(result == PARSE_INCOMPLETE && conn->request_size < sizeof(conn->request_buffer)) {
+				// Read more of the request (that's what we're here for)
+				ssize_t amount = recv(conn->client.fd, conn->request_buffer + conn->request_size, sizeof(conn->request_buffer) - conn->request_size, 0);
+
+				if(amount == -1 && would_block()) {
+					wait_on(conn, &conn->client, POLLIN);
+					return;
+				}
+
+				if(amount <= 0) {
+					// EOF or error
+					remove_connection(conn);
+					return;
+				}
+
+				conn->request_size += amount;
+				continue;
+			}
+
+			// Whole request received, or as much of one as we're going to
+			conn->request_start = monotonic_us();
+			metrics->requests++;
+
+			if(result == PARSE_ERROR) {
+				send_error(conn, BAD_REQUEST);
+				continue;
+			}
+
+			if(result == PARSE_INCOMPLETE) {
+				send_error(conn, REQUEST_TOO_LARGE);
+				continue;
+			}
+
+			struct request *request = &conn->request;
+			if(slice_equals(request->method, "GET")) {
+				conn->head = false;
+			} else if(slice_equals(request->method, "HEAD")) {
+				conn->head = true;
+			} else {
+				send_error(conn, NOT_IMPLEMENTED);
+				continue;
+			}
+
+			// The HTTP version decides whether the connection is kept alive, unless Connection: says otherwise
+			if(request->version.size != 8 || memcmp(request->version.data, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)request->version.data[7])) {
+				send_error(conn, VERSION_NOT_SUPPORTED);
+				continue;
+			}
+			conn->http_minor = request->version.data[7] - '0';
+			conn->keep_alive = conn->http_minor >= 1;
+			if(request->connection.data != NULL) {
+				connection_header(conn, request->connection.data, request->connection.size);
+			}
+
+			// Requests meant for a proxy have the scheme and host in front of the path
+			struct slice target = request->target;
+			if(target.size >= 7 && strncasecmp(target.data, "http://", 7) == 0) {
+				char *path = memchr(target.data + 7, '/', target.size - 7);
+				target.size = path != NULL ? (size_t)(target.data + target.size - path) : 0;
+				target.data = path != NULL ? path : target.data;
+			}
+
+			// Our own metrics, rather than something on the remote
+			if(metrics_path != NULL && slice_equals(target, metrics_path)) {
+				serve_metrics(conn);
+				set_state(conn, RESPONSE_WRITE);
+				continue;
+			}
+
+			// Selectors can't contain line breaks, or they'd end the request to the remote early
+			target.size = percent_decode(target.data, target.size);
+			if(memchr(target.data, '\r', target.size) != NULL || memchr(target.data, '\n', target.size) != NULL) {
+				send_error(conn, BAD_REQUEST);
+				continue;
+			}
+			conn->path = target.data;
+			conn->path_size = target.size;
+
+			set_state(conn, CONNECT);
+		}
+
+		if(conn->state == CONNECT) {
+			// Separate itemtype and selector
+			get_itemtype_selector(&conn->itemtype, &conn->path, &conn->path_size, conn->path, conn->path_size);
+
+			// Serve straight from the cache if we can
+			struct cache_entry *entry = cache_size > 0 ? cache_lookup(conn->itemtype, conn->path, conn->path_size) : NULL;
+			if(entry != NULL) {
+				entry->references++;
+				conn->cache_entry = entry;
+				if(entry->prefetched) {
+					entry->prefetched = false;
+					metrics->prefetch_hits++;
+				}
+
+				// Compressed if the client wants it that way, which is only done once for all the hits
+				conn->encoding = negotiate_encoding(conn, entry->body_size);
+				if(conn->encoding != IDENTITY && !cache_encode(entry, conn->encoding)) {
+					conn->encoding = IDENTITY;
+				}
+
+				conn->validated = true;
+				conn->checksum = entry->checksum;
+				conn->checksum_size = entry->body_size;
+				conn->modified = entry->stored;
+
+				// Create a buffer with the HTTP response header, the body gets sent from the entry after it unless the client has it already
+				if(known_response(conn, conn->encoding == IDENTITY ? entry->body_size : entry->encoded_size[conn->encoding])) {
+					set_state(conn, CACHE_WRITE);
+				}
+				continue;
+			}
+
+			// Large objects may be in the disk cache, which are sent from the file as they are
+			if(disk_cache.index != NULL) {
+				conn->file_fd = disk_cache_open(conn->itemtype, conn->path, conn->path_size, &conn->file_size, &conn->checksum, &conn->modified);
+				if(conn->file_fd != -1) {
+					conn->validated = true;
+					conn->checksum_size = conn->file_size;
+					if(known_response(conn, conn->file_size)) {
+						conn->file_offset = conn->range_start;
+						conn->file_size = conn->range_end;
+						set_state(conn, FILE_WRITE);
+					}
+					continue;
+				}
+			}
+
+			// The length of the body isn't known, so it's compressed if the client wants it that way at all
+			conn->encoding = negotiate_encoding(conn, -1);
+
+			// The header doesn't depend on the body, so a HEAD request doesn't need the remote
+			if(conn->head) {
+				response_header(conn, get_mimetype(conn->itemtype, conn->path, conn->path_size), -1);
+				set_state(conn, RESPONSE_WRITE);
+				continue;
+			}
+
+			// Join a fetch of the same thing that's already in progress, or start one others can join
+			if(use_coalescing) {
+				struct flight *flight = flight_find(conn->itemtype, conn->path, conn->path_size);
+				if(flight != NULL && !flight_joinable(flight)) {
+					// Too far along to catch up with, so leave it to its followers and fetch again
+					flight_unhash(flight);
+					flight = NULL;
+				}
+				if(flight != NULL) {
+					flight_follow(conn, flight);
+					if(flight->leader != NULL && flight->leader->prefetch) {
+						metrics->prefetch_hits++;
+					}
+					if(conn->encoding != IDENTITY) {
+						conn->encoder = get_encoder(conn->encoding);
+					}
+					response_header(conn, get_mimetype(conn->itemtype, conn->path, conn->path_size), -1);
+					set_state(conn, FLIGHT_WRITE);
+					continue;
+				}
+				flight_lead(conn);
+			}
+
+			// Start connecting to the remote, to send it the selector
+			conn->written = 0;
+			conn->connect_start = monotonic_us();
+			start_connect(conn);
+			continue;
+		}
+
+		if(conn->state == RESOLVING) {
+			// Woken up by the client, but we're still waiting for the resolver thread
+			wait_on(conn, &conn->client, 0);
+			return;
+		}
+
+		if(conn->state == CONNECTING) {
+			if(!(conn->remote.revents & (POLLOUT | POLLERR | POLLHUP))) {
+				// Woken up by something else, the connect is still in progress
+				wait_on(conn, &conn->remote, POLLOUT);
+				return;
+			}
+			conn->remote.revents = 0;
+
+			// Connect completed, see whether it succeeded
+			int error;
+			socklen_t error_size = sizeof(error);
+			if(getsockopt(conn->remote.fd, SOL_SOCKET, SO_ERROR, &error, &error_size) == -1 || error != 0) {
+				// Try the next address instead
+				connect_next(conn);
+				continue;
+			}
+
+			remote_connected(conn);
+			continue;
+		}
+
+		if(conn->state == REQUEST_WRITE) {
+			// The request is the selector followed by \r\n, sent straight from the request buffer
+			struct iovec iov[2];
+			int iovcnt = 0;
+			if(conn->written < conn->path_size) {
+				iov[iovcnt].iov_base = (char *)conn->path + conn->written;
+				iov[iovcnt].iov_len = conn->path_size - conn->written;
+				iovcnt++;
+			}
+			size_t line_end_written = conn->written > conn->path_size ? conn->written - conn->path_size : 0;
+			iov[iovcnt].iov_base = "\r\n" + line_end_written;
+			iov[iovcnt].iov_len = 2 - line_end_written;
+			iovcnt++;
+			ssize_t amount = send_iov(conn->remote.fd, iov, iovcnt);
+
+			if(amount == -1 && would_block()) {
+				wait_on(conn, &conn->remote, POLLOUT);
+				return;
+			}
+
+			if(amount == -1) {
+				remove_connection(conn);
+				return;
+			}
+
+			conn->written += amount;
+			TRACE3(remote_send, conn->id, amount, conn->written);
+
+			if(conn->written >= conn->path_size + 2) {
+				// Create new buffer with HTTP response, the length of the body isn't known
+				response_header(conn, get_mimetype(conn->itemtype, conn->path, conn->path_size), -1);
+
+				// Move on to writing the header to the client
+				set_state(conn, HEADER_WRITE);
+				continue;
+			}
+		}
+
+		if(conn->state == HEADER_WRITE) {
+			// A prefetch has nobody to send it to
+			char *start = conn->buffer + conn->written;
+			size_t left = conn->buffer_size - conn->written;
+			ssize_t amount = conn->prefetch ? (ssize_t)left : send(conn->client.fd, start, left, MSG_NOSIGNAL);
+
+			if(amount == -1 && would_block()) {
+				wait_on(conn, &conn->client, POLLOUT);
+				return;
+			}
+
+			if(amount == -1) {
+				remove_connection(conn);
+				return;
+			}
+
+			conn->written += amount;
+			conn->bytes_sent += amount;
+
+			if(conn->written >= conn->buffer_size) {
+				// Done with the header
+				conn->buffer = NULL;
+				conn->buffer_size = 0;
+
+				// Set copying mode
+				conn->copymode = get_copymode(conn->itemtype);
+
+				// Keep a copy of the body for the cache, if it's going to be cached
+				conn->capturing = (cache_size > 0 || disk_cache.index != NULL) && cache_ttl(conn->itemtype) > 0;
+
+				// Binary bodies are passed on as they are, so splice them through a pipe if we can
+				// Everything else, and binary bodies we're keeping a copy of for the cache or other requests, goes through the ring buffer
+				conn->pipe_fill = 0;
+				if(!(conn->copymode == BINARY && !conn->capturing && !flight_tapped(conn) && use_splice && get_pipe(&conn->pipe_pair))) {
+					ring_setup(&conn->ring, conn->ring_memory, ring_size);
+				}
+
+				// Gophermaps get translated into HTML on the way, and text of either kind maybe compressed
+				if(conn->copymode == GOPHERMAP) {
+					gophermap_setup(conn);
+				}
+				if(conn->encoding != IDENTITY) {
+					conn->encoder = get_encoder(conn->encoding);
+				}
+				conn->remote_eof = false;
+				conn->paused = false;
+
+				// Set conn->beginning_of_line in case copymode uses that information
+				conn->beginning_of_line = true;
+
+				// Move on to streaming the body from the remote to the client
+				set_state(conn, STREAM);
+				continue;
+			}
+		}
+
+		if(conn->state == STREAM) {
+			// Read from the remote and write to the client for as long as either makes progress
+			bool remote_blocked = false;
+			bool client_blocked = false;
+			bool progress = true;
+
+			while(progress) {
+				progress = false;
+
+				// A prefetch is of no use once its body can't be cached and nobody has joined it
+				if(conn->prefetch && !conn->capturing && !flight_tapped(conn)) {
+					remove_connection(conn);
+					return;
+				}
+
+				// Backpressure: stop reading from the remote at the high watermark until the client has caught up
+				// A pipe may be smaller than the ring buffer would have been, so the watermarks are capped at its size
+				// Once a binary body turns out too large for the cache and for others to join, switch to splicing it as soon as the ring buffer is empty
+				if(conn->copymode == BINARY && !conn->capturing && !flight_tapped(conn) && use_splice && conn->ring.data != NULL && conn->ring.fill == 0 && get_pipe(&conn->pipe_pair)) {
+					conn->ring.data = NULL;
+				}
+				// And the other way round, when a request joins before any of a spliced body has arrived, so the body gets kept for it
+				if(conn->pipe_pair.read_fd != -1 && flight_tapped(conn) && conn->pipe_fill == 0) {
+					put_pipe(&conn->pipe_pair, true);
+					ring_setup(&conn->ring, conn->ring_memory, ring_size);
+				}
+
+				// Requests following this one hold it back as well, so the body doesn't pile up for the slowest of them
+				size_t fill = stream_fill(conn);
+				if(flight_backlog(conn) > fill) {
+					fill = flight_backlog(conn);
+				}
+				size_t high = high_watermark;
+				size_t low = low_watermark;
+				if(conn->pipe_pair.read_fd != -1 && high > conn->pipe_pair.size) {
+					high = conn->pipe_pair.size;
+					low = low < high / 2 ? low : high / 2;
+				}
+				if(conn->paused && fill <= low) {
+					conn->paused = false;
+				} else if(!conn->paused && fill >= high) {
+					conn->paused = true;
+				}
+
+				if(!conn->remote_eof && !conn->paused && !remote_blocked) {
+					ssize_t amount = stream_from_remote(conn);
+
+					if(amount == -1 && would_block()) {
+						remote_blocked = true;
+					} else if(amount == -1) {
+						remove_connection(conn);
+						return;
+					} else if(amount == 0) {
+						// EOF reached, the remote isn't needed anymore
+						conn->remote_eof = true;
+						close_remote(conn);
+						progress = true;
+					} else {
+						progress = true;
+						if(conn->prefetch) {
+							prefetch.budget -= amount;
+						}
+					}
+				}
+
+				if(stream_fill(conn) > 0 && !client_blocked) {
+					ssize_t amount = stream_to_client(conn);
+
+					if(amount == -1 && would_block()) {
+						client_blocked = true;
+					} else if(amount == -1) {
+						remove_connection(conn);
+						return;
+					} else if(amount > 0) {
+						progress = true;
+
+						// A pipe can run out of room before its size is reached, which makes splicing into it fail as if the remote had nothing for us
+						// Having made room, try the remote again
+						if(conn->pipe_pair.read_fd != -1) {
+							remote_blocked = false;
+						}
+					}
+				}
+
+				if(conn->remote_eof && stream_fill(conn) == 0) {
+					// Everything has been passed on, so the copy is complete and can go to the cache
+					flight_complete(conn);
+					if(conn->capturing) {
+						finish_capture(conn);
+					}
+
+					// A chunked body ends with an empty chunk
+					if(conn->chunked) {
+						frame_append(conn, "0\r\n\r\n");
+						set_state(conn, LAST_CHUNK_WRITE);
+						break;
+					}
+
+					// We're done with the response
+					if(!finish_response(conn)) {
+						return;
+					}
+					break;
+				}
+			}
+
+			// Done with the body, on to the end of the response or the next request
+			if(conn->state != STREAM) {
+				continue;
+			}
+
+			// Don't hold back what's been compressed so far while waiting for more from the remote
+			if(remote_blocked && !client_blocked && conn->encoder != NULL && !encoder_send(conn, Z_SYNC_FLUSH)) {
+				if(!would_block()) {
+					remove_connection(conn);
+					return;
+				}
+				client_blocked = true;
+			}
+
+			// Wait on whichever sides we're blocked on, timing out on the client first as it's the one holding things up
+			if(conn->remote.fd != -1) {
+				socket_interest(&conn->remote, remote_blocked ? POLLIN : 0);
+			}
+			if(conn->client.fd != -1) {
+				socket_interest(&conn->client, client_blocked ? POLLOUT : 0);
+			}
+			set_timeout(conn, client_blocked ? CLIENT_TIMEOUT : remote_blocked ? REMOTE_TIMEOUT : NO_TIMEOUT);
+			return;
+		}
+
+		if(conn->state == LAST_CHUNK_WRITE) {
+			if(!send_frame(conn, 0)) {
+				if(would_block()) {
+					wait_on(conn, &conn->client, POLLOUT);
+				} else {
+					remove_connection(conn);
+				}
+				return;
+			}
+
+			// We're done with the response
+			if(!finish_response(conn)) {
+				return;
+			}
+			continue;
+		}
+
+		if(conn->state == CACHE_WRITE) {
+			// Write the header and the cached body, together as far as possible
+			// Only the range asked for, if any
+			struct cache_entry *entry = conn->cache_entry;
+			char *body = (conn->encoding == IDENTITY ? entry->body : entry->encoded[conn->encoding]) + conn->range_start;
+			size_t body_size = conn->range_end - conn->range_start;
+			struct iovec iov[2];
+			int iovcnt = 0;
+			size_t body_written = 0;
+
+			if(conn->written < conn->buffer_size) {
+				iov[iovcnt].iov_base = conn->buffer + conn->written;
+				iov[iovcnt].iov_len = conn->buffer_size - conn->written;
+				iovcnt++;
+			} else {
+				body_written = conn->written - conn->buffer_size;
+			}
+			if(body_written < body_size && !conn->head) {
+				iov[iovcnt].iov_base = body + body_written;
+				iov[iovcnt].iov_len = body_size - body_written;
+				iovcnt++;
+			}
+
+			if(iovcnt == 0) {
+				// Everything sent, we're done with the response
+				if(!finish_response(conn)) {
+					return;
+				}
+				continue;
+			}
+
+			ssize_t amount = send_iov(conn->client.fd, iov, iovcnt);
+
+			if(amount == -1 && would_block()) {
+				wait_on(conn, &conn->client, POLLOUT);
+				return;
+			}
+
+			if(amount == -1) {
+				remove_connection(conn);
+				return;
+			}
+
+			conn->written += amount;
+			conn->bytes_sent += amount;
+			continue;
+		}
+
+		if(conn->state == FLIGHT_WRITE) {
+			// Send the header and then the body as the leader gets it, from our own offset
+			struct flight *flight = conn->flight;
+			size_t available = flight->base + flight->data_size - conn->flight_offset;
+
+			if(flight->failed && conn->written == 0) {
+				// Nothing sent yet, so the client can still be told
+				send_error(conn, FETCH_FAILED);
+				continue;
+			}
+			if(flight->failed) {
+				remove_connection(conn);
+				return;
+			}
+
+			if(available == 0 && conn->encoder != NULL && conn->written >= conn->buffer_size && !encoder_send(conn, flight->complete ? Z_FINISH : Z_SYNC_FLUSH)) {
+				// The rest of the compressed body has to go out before waiting for more, or finishing
+				if(would_block()) {
+					wait_on(conn, &conn->client, POLLOUT);
+				} else {
+					remove_connection(conn);
+				}
+				return;
+			}
+
+			if(available == 0 && flight->complete && conn->written >= conn->buffer_size) {
+				// Everything sent, a chunked body ends with an empty chunk
+				if(conn->chunked) {
+					frame_append(conn, "0\r\n\r\n");
+					set_state(conn, LAST_CHUNK_WRITE);
+					continue;
+				}
+				if(!finish_response(conn)) {
+					return;
+				}
+				continue;
+			}
+
+			if(available == 0 && !flight->complete) {
+				// Caught up with the leader, which wakes us up once it has more
+				// The header waits for the body, so the client can still be told if the fetch fails before that
+				conn->flight_waiting = true;
+				wait_on(conn, &conn->client, 0);
+				return;
+			}
+
+			ssize_t amount;
+			if(conn->written < conn->buffer_size) {
+				amount = send(conn->client.fd, conn->buffer + conn->written, conn->buffer_size - conn->written, MSG_NOSIGNAL | MSG_MORE);
+				if(amount > 0) {
+					conn->written += amount;
+					conn->bytes_sent += amount;
+				}
+			} else {
+				struct iovec iov = {.iov_base = flight->data + (conn->flight_offset - flight->base), .iov_len = available};
+				amount = send_body(conn, &iov, 1);
+				if(amount > 0) {
+					conn->flight_offset += amount;
+					flight_trim(flight);
+				}
+			}
+
+			if(amount == -1 && would_block()) {
+				wait_on(conn, &conn->client, POLLOUT);
+				return;
+			}
+
+			if(amount == -1) {
+				remove_connection(conn);
+				return;
+			}
+			continue;
+		}
+
+		if(conn->state == FILE_WRITE) {
+			if(conn->written >= conn->buffer_size && (conn->file_offset >= conn->file_size || conn->head)) {
+				// Everything sent, we're done with the response
+				if(!finish_response(conn)) {
+					return;
+				}
+				continue;
+			}
+
+			ssize_t amount;
+			if(conn->written < conn->buffer_size) {
+				// Header first, telling the kernel the body follows
+				amount = send(conn->client.fd, conn->buffer + conn->written, conn->buffer_size - conn->written, MSG_NOSIGNAL | (conn->head ? 0 : MSG_MORE));
+				if(amount > 0) {
+					conn->written += amount;
+					conn->bytes_sent += amount;
+				}
+			} else {
+				// Body straight from the file
+				amount = sendfile(conn->client.fd, conn->file_fd, &conn->file_offset, conn->file_size - conn->file_offset);
+				if(amount > 0) {
+					conn->bytes_sent += amount;
+				}
+			}
+
+			if(amount == -1 && would_block()) {
+				wait_on(conn, &conn->client, POLLOUT);
+				return;
+			}
+
+			if(amount <= 0) {
+				// Error or file cut short, and the client has been promised the whole length
+				remove_connection(conn);
+				return;
+			}
+			continue;
+		}
+
+		if(conn->state == RESPONSE_WRITE) {
+			// Whole response in memory, e.g. an error or the answer to a HEAD request: the header in the buffer, and maybe a body of our own after it
+			struct iovec iov[2];
+			int iovcnt = 0;
+			if(conn->written < conn->buffer_size) {
+				iov[iovcnt].iov_base = conn->buffer + conn->written;
+				iov[iovcnt].iov_len = conn->buffer_size - conn->written;
+				iovcnt++;
+			}
+			size_t body_written = conn->written > conn->buffer_size ? conn->written - conn->buffer_size : 0;
+			size_t body_size = conn->head ? 0 : conn->response_body_size;
+			if(body_written < body_size) {
+				iov[iovcnt].iov_base = conn->response_body + body_written;
+				iov[iovcnt].iov_len = body_size - body_written;
+				iovcnt++;
+			}
+			ssize_t amount = iovcnt > 0 ? send_iov(conn->client.fd, iov, iovcnt) : 0;
+
+			if(amount == -1 && would_block()) {
+				wait_on(conn, &conn->client, POLLOUT);
+				return;
+			}
+
+			if(amount == -1) {
+				remove_connection(conn);
+				return;
+			}
+
+			conn->written += amount;
+			conn->bytes_sent += amount;
+
+			if(conn->written >= conn->buffer_size + body_size) {
+				// Response sent
+				if(!finish_response(conn)) {
+					return;
+				}
+			}
+		}
+	}
+}
+
+void timeout_connection(struct connection *conn) {
+	enum timeout timeout = conn->timeout;
+	conn->timeout = NO_TIMEOUT;
+	metrics->timeouts[timeout]++;
+
+	if(timeout == HEADER_TIMEOUT) {
+		if(conn->request_size == 0) {
+			// Idle between requests, nobody to tell
+			remove_connection(conn);
+			return;
+		}
+		send_error(conn, REQUEST_TIMEOUT);
+	} else if(timeout == CONNECT_TIMEOUT) {
+		// Took too long, try the next address
+		resolving_remove(conn);
+		conn->timed_out = true;
+		connect_next(conn);
+	} else if(timeout == REMOTE_TIMEOUT && conn->state == REQUEST_WRITE) {
+		// No response header sent yet, so the client can still be told
+		send_error(conn, REMOTE_TIMED_OUT);
+	} else {
+		// The client or the remote stopped partway through the response
+		remove_connection(conn);
+		return;
+	}
+	handle_connection(conn);
+}
+
+void run_timers(void) {
+	long long int now = monotonic_ms() / TIMER_TICK;
+	while(wheel.tick < now) {
+		wheel.tick++;
+
+		// Bring the timers of the higher levels down once the levels below have come full circle
+		for(size_t level = 1; level < WHEEL_LEVELS; level++) {
+			if((wheel.tick & ((1LL << (WHEEL_BITS * level)) - 1)) != 0) {
+				break;
+			}
+			struct timer **slot = &wheel.slots[level][(wheel.tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+			struct timer *timer = *slot;
+			*slot = NULL;
+			while(timer != NULL) {
+				struct timer *next = timer->next;
+				timer_insert(timer, timer->expires);
+				timer = next;
+			}
+		}
+
+		// Handling a timeout may set other timers, but never into the current slot, so this runs out
+		struct timer **slot = &wheel.slots[0][wheel.tick & (WHEEL_SLOTS - 1)];
+		while(*slot != NULL) {
+			struct timer *timer = *slot;
+			timer_remove(timer);
+			timeout_connection(timer->conn);
+		}
+	}
+}
+
+void addresses_resolved(void) {
+	uint64_t count;
+	if(read(resolver_handle.fd, &count, sizeof(count)) == -1 && !would_block()) {
+		perror("read");
+		exit(1);
+	}
+
+	struct addrinfo *results[BACKENDS_MAX];
+	bool have_result[BACKENDS_MAX];
+	pthread_mutex_lock(&resolver_mutex);
+	for(size_t i = 0; i < number_backends; i++) {
+		results[i] = backends[i].resolved_addresses;
+		have_result[i] = backends[i].resolved;
+		backends[i].resolved_addresses = NULL;
+		backends[i].resolved = false;
+	}
+	pthread_mutex_unlock(&resolver_mutex);
+
+	for(size_t i = 0; i < number_backends; i++) {
+		struct backend *backend = &backends[i];
+		struct addrinfo *addresses = results[i];
+		if(!have_result[i]) {
+			continue;
+		}
+
+		// On failure, keep using the addresses we have, if any
+		backend->lookup_failed = addresses == NULL && backend->addresses == NULL;
+		if(addresses == NULL) {
+			continue;
+		}
+
+		struct address_list *list = calloc(1, sizeof(struct address_list));
+		if(list == NULL) {
+			perror("calloc");
+			exit(1);
+		}
+		list->addresses = addresses;
+		list->references = 1;
+
+		if(backend->addresses != NULL) {
+			// Carry the preferred address over, if it's still around
+			for(struct addrinfo *res = addresses; res != NULL && backend->addresses->preferred != NULL; res = res->ai_next) {
+				if(same_address(res, backend->addresses->preferred)) {
+					list->preferred = res;
+					break;
+				}
+			}
+			release_address_list(backend->addresses);
+		}
+		backend->addresses = list;
+	}
+
+	// Let the connections waiting for addresses proceed
+	// Those that have to keep waiting get appended to the list again, so stop at its current end
+	struct connection *last = resolving_tail;
+	struct connection *next = resolving_head;
+	while(next != NULL) {
+		struct connection *conn = next;
+		next = conn == last ? NULL : conn->resolving_next;
+
+		resolving_remove(conn);
+		start_connect(conn);
+		handle_connection(conn);
+	}
+}
+
+void probe_finish(struct backend *backend, bool healthy) {
+	unwatch_socket(&backend->probe);
+	close(backend->probe.fd);
+	backend->probe.fd = -1;
+
+	if(!healthy) {
+		backend_failed(backend);
+		return;
+	}
+	backend->failures = 0;
+	if(!backend->healthy) {
+		log_error("%s: Backend %s healthy again\n", program_name, backend->name);
+		backend->healthy = true;
+		metrics->backend_ejected[backend - backends] = 0;
+	}
+}
+
+void probe_backend(struct backend *backend) {
+	// Lookups that fail count against the backend, those not done yet don't
+	if(backend->addresses == NULL) {
+		if(backend->lookup_failed) {
+			backend_failed(backend);
+		}
+		return;
+	}
+
+	struct addrinfo *res = backend->addresses->preferred != NULL ? backend->addresses->preferred : backend->addresses->addresses;
+	int sock = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+	if(sock == -1) {
+		perror("socket");
+		return;
+	}
+	if(connect(sock, res->ai_addr, res->ai_addrlen) == -1 && errno != EINPROGRESS) {
+		close(sock);
+		backend_failed(backend);
+		return;
 	}
-}
 
-void handle_connection(size_t index) {
-	struct connection *conn = connections[index];
+	// The whole probe gets as long as a connect would
+	backend->probe.fd = sock;
+	backend->probe.events = POLLOUT;
+	backend->probe.revents = 0;
+	backend->probe_sent = false;
+	backend->probe_deadline = monotonic_ms() + connect_timeout;
+	watch_socket(&backend->probe);
+}
 
-	if(conn->state == START || conn->state == PATH) {
-		// Read data (that's what we're here for) and append to buffer
-		char buffer[1024];
-		ssize_t amount = recv(conn->sock, &buffer, sizeof(buffer), 0);
+void probe_progress(struct backend *backend) {
+	// Connect, send the empty selector, and take any answer at all as the backend being healthy
+	if(backend->probe.fd == -1) {
+		// Finished while handling an earlier event of this batch
+		return;
+	}
 
-		if(amount <= 0) {
-			// EOF or error
-			remove_connection(index);
+	if(!backend->probe_sent) {
+		if(!(backend->probe.revents & (POLLOUT | POLLERR | POLLHUP))) {
 			return;
 		}
-
-		buffer_append(&conn->buffer, &conn->buffer_size, buffer, amount);
-	} else if(conn->state == REQUEST_END) {
-		// Read data and keep the last 4 bytes (only interested in \r\n\r\n)
-		char buffer[1024];
-		size_t buffer_fill = conn->buffer_size;
-		memmove(buffer, conn->buffer, buffer_fill);
-		ssize_t amount = recv(conn->sock, &buffer + buffer_fill, sizeof(buffer) - buffer_fill, 0);
-
-		if(amount <= 0) {
-			// EOF or error
-			remove_connection(index);
+		int error;
+		socklen_t error_size = sizeof(error);
+		if(getsockopt(backend->probe.fd, SOL_SOCKET, SO_ERROR, &error, &error_size) == -1 || error != 0 || send(backend->probe.fd, "\r\n", 2, MSG_NOSIGNAL) != 2) {
+			probe_finish(backend, false);
 			return;
 		}
+		backend->probe_sent = true;
+		socket_interest(&backend->probe, POLLIN);
+	}
 
-		buffer_fill += amount;
+	char answer[64];
+	ssize_t amount = recv(backend->probe.fd, answer, sizeof(answer), 0);
+	if(amount == -1 && would_block()) {
+		return;
+	}
+	probe_finish(backend, amount > 0);
+}
 
-		if(buffer_fill < 4) {
-			memmove(conn->buffer, buffer, buffer_fill);
-			conn->buffer_size = buffer_fill;
-		} else {
-			memmove(conn->buffer, &buffer[buffer_fill - 4], 4);
-			conn->buffer_size = 4;
+int probe_wait(int timeout) {
+	// Shortens the timeout of waiting for events to when the next probes are due or the first in progress times out
+	if(health_interval == 0) {
+		return timeout;
+	}
+	long long int due = next_probes;
+	for(size_t i = 0; i < number_backends; i++) {
+		if(backends[i].probe.fd != -1 && backends[i].probe_deadline < due) {
+			due = backends[i].probe_deadline;
 		}
 	}
+	long long int left = due - monotonic_ms();
+	if(left < 0) {
+		left = 0;
+	}
+	return timeout == -1 || left < timeout ? left : timeout;
+}
 
-	if(conn->state == START) {
-		// Check buffer's contents to see if we can move to next state
-		if(conn->buffer_size >= 4 && memcmp(conn->buffer, "GET ", 4) == 0) {
-			// Remove the first 4 bytes (not needed by us) from the buffer
-			conn->buffer_size = conn->buffer_size - 4;
-			memmove(conn->buffer, conn->buffer + 4, conn->buffer_size);
+void run_probes(void) {
+	if(health_interval == 0) {
+		return;
+	}
 
-			conn->state = PATH;
+	long long int now = monotonic_ms();
+	for(size_t i = 0; i < number_backends; i++) {
+		if(backends[i].probe.fd != -1 && now >= backends[i].probe_deadline) {
+			probe_finish(&backends[i], false);
 		}
 	}
 
-	if(conn->state == PATH) {
-		char *path_end = memchr(conn->buffer, ' ', conn->buffer_size);
-		if(path_end != NULL) {
-			// Copy the path from buffer into separate path buffer
-			conn->path_size = path_end - conn->buffer;
-			conn->path = memdup(conn->buffer, conn->path_size);
-
-			// Copy max. 4 bytes off the end, in case it has \r\n\r\n
-			size_t left_over = conn->buffer_size - conn->path_size;
-			char tmpbuf[4];
-			size_t tmpbuf_size;
-			if(left_over < 4) {
-				memmove(&tmpbuf, path_end, left_over);
-				tmpbuf_size = left_over;
-			} else {
-				memmove(&tmpbuf, &conn->buffer[conn->buffer_size - 4], 4);
-				tmpbuf_size = 4;
+	if(now >= next_probes) {
+		next_probes = now + health_interval * 1000;
+		for(size_t i = 0; i < number_backends; i++) {
+			if(backends[i].probe.fd == -1) {
+				probe_backend(&backends[i]);
 			}
+		}
+	}
+}
 
-			// Free the buffer and replace it with a tiny one, store the copied bytes
-			free(conn->buffer);
-			conn->buffer = malloc(4);
-			if(conn->buffer == NULL) {
-				perror("malloc");
-				exit(1);
-			}
-			memmove(conn->buffer, &tmpbuf, tmpbuf_size);
-			conn->buffer_size = tmpbuf_size;
+void start_prefetch(struct prefetch_link *link) {
+	// Fetched like the request of a client would be, only without the client, so whatever would go to it fails and an error ends the prefetch
+	struct connection *conn = new_connection(-1);
+	conn->prefetch = true;
+	conn->state = CONNECT;
+	prefetch.running++;
+	metrics->prefetches++;
+
+	memcpy(conn->request_buffer, link->selector, link->selector_size);
+	conn->itemtype = link->itemtype;
+	conn->path = conn->request_buffer;
+	conn->path_size = link->selector_size;
+
+	// Requests for the same item coming in meanwhile join the prefetch
+	if(use_coalescing) {
+		flight_lead(conn);
+	}
+
+	conn->request_start = monotonic_us();
+	conn->connect_start = conn->request_start;
+	start_connect(conn);
+	handle_connection(conn);
+}
+
+int prefetch_wait(int timeout) {
+	// Shortens the timeout of waiting for events to when the budget allows the next prefetch, checking at least every second
+	if(prefetch.fill == 0 || prefetch.running >= (size_t)prefetch_concurrency || prefetch.budget > 0) {
+		return timeout;
+	}
+	long long int left = -prefetch.budget * 1000 / prefetch_budget + 1;
+	if(left > 1000) {
+		left = 1000;
+	}
+	return timeout == -1 || left < timeout ? left : timeout;
+}
+
+void run_prefetches(void) {
+	if(prefetch_links == 0) {
+		return;
+	}
 
-			conn->state = REQUEST_END;
+	// Top up the budget for the time gone by
+	long long int now = monotonic_ms();
+	if(now - prefetch.refilled >= 1000) {
+		prefetch.budget = prefetch_budget;
+		prefetch.refilled = now;
+	} else {
+		long long int topup = (now - prefetch.refilled) * prefetch_budget / 1000;
+		if(topup > 0) {
+			prefetch.budget = prefetch.budget + topup < prefetch_budget ? prefetch.budget + topup : prefetch_budget;
+			prefetch.refilled = now;
 		}
 	}
 
-	if(conn->state == REQUEST_END) {
-		if(conn->buffer_size >= 4 && memcmp(conn->buffer, "\r\n\r\n", 4) == 0) {
-			// Completely remove the buffer
-			free(conn->buffer);
-			conn->buffer = NULL;
-			conn->buffer_size = 0;
+	// Upstream capacity goes to clients first: not while we've stopped accepting them, and only a few prefetches at a time
+	while(prefetch.fill > 0 && prefetch.running < (size_t)prefetch_concurrency && prefetch.budget > 0 && accepting) {
+		struct prefetch_link link = prefetch.queue[prefetch.head];
+		prefetch.head = (prefetch.head + 1) % PREFETCH_QUEUE;
+		prefetch.fill--;
 
-			conn->state = CONNECT;
+		// Fetched by a client or another worker since being queued, maybe
+		if(prefetch_wanted(link.itemtype, link.selector, link.selector_size)) {
+			start_prefetch(&link);
 		}
+		free(link.selector);
 	}
+}
+
+void drop_privileges(void) {
+	uid_t uid = getuid();
+	gid_t gid = getgid();
 
-	if(conn->state == CONNECT) {
-			// Connect to remote and change it to our main socket
-			size_t remote_socket = connect_to_remote();
-			conn->sock_other = conn->sock;
-			conn->sock = remote_socket;
+	if(setresgid(gid, gid, gid) != 0) {
+		perror("setresgid");
+		exit(1);
+	}
+	if(setresuid(uid, uid, uid) != 0) {
+		perror("setresuid");
+		exit(1);
+	}
+}
 
-			// Change socket in the table of sockets
-			socket_change(conn->sock_other, remote_socket, POLLOUT);
 
-			// Separate itemtype and selector
-			char *path;
-			size_t path_size;
-			get_itemtype_selector(&conn->itemtype, &path, &path_size, conn->path, conn->path_size);
-			free(conn->path);
-			conn->path = path;
-			conn->path_size = path_size;
-
-			// Put conn->path to conn->buffer and append \r\n to it to create a valid request
-			conn->buffer = memdup(conn->path, conn->path_size);
-			conn->buffer_size = conn->path_size;
-			buffer_append(&conn->buffer, &conn->buffer_size, "\r\n", 2);
-
-			conn->state = REQUEST_WRITE;
-			// Do not continue onwards to REQUEST_WRITE's code, because we changed the socket mid-function and REQUEST_WRITE's code assumes function got called with POLLOUT revent
-			return;
+void watch_listeners(size_t first, size_t number) {
+	first_own_listener = first;
+	number_own_listeners = number;
+	for(size_t i = first; i < first + number; i++) {
+		watch_socket(listeners[i]);
 	}
+}
 
-	if(conn->state == REQUEST_WRITE) {
-		char *start = conn->buffer + conn->written;
-		size_t left = conn->buffer_size - conn->written;
-		ssize_t amount = send(conn->sock, start, left, 0);
+void handle_woken_connections(void) {
+	while(woken_connections != NULL) {
+		struct connection *conn = woken_connections;
+		woken_connections = conn->next_woken;
+		conn->woken = false;
+		if(!conn->closed) {
+			handle_connection(conn);
+		}
+	}
+}
 
-		if(amount == -1) {
-			remove_connection(index);
-			return;
+void event_loop(void) {
+	struct event events[MAX_EVENTS];
+	while(1) {
+		// Wake up in time for the first timer, or to see whether we can accept connections again
+		int timeout = timer_wait();
+		if(!accepting && (timeout == -1 || timeout > ACCEPT_RETRY)) {
+			timeout = ACCEPT_RETRY;
 		}
+		timeout = probe_wait(timeout);
+		timeout = prefetch_wait(timeout);
+		size_t amount_ready = wait_events(events, MAX_EVENTS, timeout);
 
-		conn->written += amount;
+		// With no timers set the wheel stands still, so bring it up to date before any get set
+		if(wheel.armed == 0) {
+			wheel.tick = monotonic_ms() / TIMER_TICK;
+		}
 
-		if(conn->written >= conn->buffer_size) {
-			// Completely remove the old buffer containig the request
-			free(conn->buffer);
-			conn->buffer = NULL;
-			conn->buffer_size = 0;
+		if(stats_requested) {
+			stats_requested = 0;
+			log_stats();
+		}
 
-			// Create new buffer with HTTP response
-			const char *mimetype = get_mimetype(conn->itemtype, conn->path, conn->path_size);
-			char *response;
-			int response_size = asprintf(&response, "HTTP/1.1 200 OK\r\nContent-type: %s\r\n\r\n", mimetype);
-			if(response_size < 0) {
-				perror("asprintf");
-				exit(1);
-			}
-			conn->buffer = response;
-			conn->buffer_size = response_size;
+		for(size_t i = 0; i < amount_ready; i++) {
+			struct handle *handle = events[i].handle;
 
-			// Set amount written to 0
-			conn->written = 0;
+			if(handle->type == LISTEN_HANDLE) {
+				// Interface socket
+				accept_connections(handle);
+				continue;
+			}
 
-			// Switch socket and change to write mode
-			switch_sockets(conn);
-			socket_change(conn->sock_other, conn->sock, POLLOUT);
+			if(handle->type == RESOLVER_HANDLE) {
+				addresses_resolved();
+				continue;
+			}
 
-			conn->state = HEADER_WRITE;
-			// Return because socket was changed
-			return;
-		}
-	}
+			if(handle->type == PROBE_HANDLE) {
+				handle->revents = events[i].revents;
+				probe_progress((struct backend *)((char *)handle - offsetof(struct backend, probe)));
+				continue;
+			}
 
-	if(conn->state == HEADER_WRITE) {
-		char *start = conn->buffer + conn->written;
-		size_t left = conn->buffer_size - conn->written;
-		ssize_t amount = send(conn->sock, start, left, 0);
+			// Data socket
+			struct connection *conn = handle->conn;
+			if(conn->closed) {
+				// Removed while handling an earlier event of this batch
+				continue;
+			}
+			handle->revents = events[i].revents;
 
-		if(amount == -1) {
-			remove_connection(index);
-			return;
+			if(handle->type == CLIENT_HANDLE && events[i].revents & (POLLHUP | POLLERR)) {
+				// Client is gone, nothing left to do for it
+				remove_connection(conn);
+			} else {
+				// Anything else, including a hangup of the remote, is found out by the state machine when it tries to do I/O
+				handle_connection(conn);
+			}
 		}
 
-		conn->written += amount;
+		run_timers();
+		run_probes();
+		run_prefetches();
+		handle_woken_connections();
+		free_closed_connections();
+		publish_metrics();
+		if(!accepting) {
+			resume_accepting();
+		}
+	}
+}
 
-		if(conn->written >= conn->buffer_size) {
-			// Completely remove the old buffer containig the header
-			free(conn->buffer);
-			conn->buffer = NULL;
-			conn->buffer_size = 0;
+void handle_stop(int signal) {
+	(void)signal;
+	stop_requested = 1;
+}
 
-			// Allocate a fixed buffer for data copying
-			conn->buffer = malloc(1024);
-			if(conn->buffer == NULL) {
-				perror("malloc");
-				exit(1);
-			}
-			conn->buffer_size = 1024;
+void handle_stats(int signal) {
+	(void)signal;
+	stats_requested = 1;
+}
 
-			// Set copying mode
-			conn->copymode = get_copymode(conn->itemtype);
+void handle_reopen(int signal) {
+	(void)signal;
+	reopen_requested = 1;
+}
 
-			// Set conn->beginning_of_line in case copymode uses that information
-			conn->beginning_of_line = true;
+void setup_reopen_signal(void) {
+	struct sigaction reopen_action = {.sa_handler = handle_reopen};
+	sigemptyset(&reopen_action.sa_mask);
+	sigaction(SIGUSR1, &reopen_action, NULL);
+}
 
-			// Switch socket and change to read mode
-			switch_sockets(conn);
-			socket_change(conn->sock_other, conn->sock, POLLIN);
+void setup_stats_signal(void) {
+	// No SA_RESTART, so the signal interrupts waiting for events and gets handled right away
+	struct sigaction stats_action = {.sa_handler = handle_stats};
+	sigemptyset(&stats_action.sa_mask);
+	sigaction(SIGUSR2, &stats_action, NULL);
+}
 
-			conn->state = READ;
-			// Return because socket was changed
-			return;
-		}
+void start_worker(size_t index) {
+	pid_t supervisor = getpid();
+	pid_t pid = fork();
+	if(pid < 0) {
+		perror("fork");
+		exit(1);
 	}
 
-	if(conn->state == READ) {
-		ssize_t amount = recv(conn->sock, conn->buffer, conn->buffer_size, 0);
+	if(pid == 0) {
+		// Worker: go back to default signal handling and die along with the supervisor
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		stats_requested = 0;
+		reopen_requested = 0;
+		if(prctl(PR_SET_PDEATHSIG, SIGTERM) == -1) {
+			perror("prctl");
+			exit(1);
+		}
+		if(getppid() != supervisor) {
+			// Supervisor died before we could ask to be told about it
+			exit(1);
+		}
 
-		if(amount == -1) {
-			remove_connection(index);
-			return;
+		// Only keep our own listening sockets
+		worker_index = index;
+		struct worker *worker = &worker_table[index];
+		for(size_t i = 0; i < number_listeners; i++) {
+			if(i < worker->first_listener || i >= worker->first_listener + worker->number_listeners) {
+				close(listeners[i]->fd);
+			}
 		}
 
-		if(amount == 0) {
-			// EOF reached
-			remove_connection(index);
-			return;
+		use_metrics(index);
+		setup_engine();
+		setup_connection_pool();
+		watch_listeners(worker->first_listener, worker->number_listeners);
+		setup_resolver();
+		setup_disk_cache();
+		if(access_log_fd != -1) {
+			start_access_log();
 		}
+		event_loop();
+	}
 
-		// Store the amount of data that's been read into the buffer and reset the amount written
-		conn->read = amount;
-		conn->written = 0;
+	worker_table[index].pid = pid;
+	worker_table[index].started = time(NULL);
+}
 
-		// Switch socket and change to write mode
-		switch_sockets(conn);
-		socket_change(conn->sock_other, conn->sock, POLLOUT);
+void supervise(void) {
+	worker_table = calloc(workers, sizeof(*worker_table));
+	if(worker_table == NULL) {
+		perror("calloc");
+		exit(1);
+	}
 
-		conn->state = WRITE;
-		// Return because socket was changed
-		return;
+	// Set up a set of listening sockets for every worker
+	// The supervisor keeps them open, so a restarted worker takes over its predecessor's sockets along with the connections queued on them
+	for(long int i = 0; i < workers; i++) {
+		worker_table[i].first_listener = number_listeners;
+		setup_listen(server_port);
+		worker_table[i].number_listeners = number_listeners - worker_table[i].first_listener;
 	}
-	
-	if(conn->state == WRITE) {
-		ssize_t amount;
-		ssize_t skipped = 0;
 
-		if(conn->copymode == GOPHERMAP) {
-			log_error("Gophermap copymode not yet supported, substituting text copymode\n");
-			conn->copymode = TEXT;
-		}
+	// All binding is done, so drop privileges or die trying
+	drop_privileges();
 
-		if(conn->copymode == BINARY) {
-			char *start = conn->buffer + conn->written;
-			size_t left = conn->read - conn->written;
-			amount = send(conn->sock, start, left, 0);
-		} else if(conn->copymode == TEXT) {
-			char *start = conn->buffer + conn->written;
-			size_t max_left = conn->read - conn->written;
+	// Daemonization ignores SIGCHLD, but we need to wait for our workers
+	// No SA_RESTART for the stop signals, so they interrupt waitpid()
+	struct sigaction stop_action = {.sa_handler = handle_stop};
+	sigemptyset(&stop_action.sa_mask);
+	sigaction(SIGTERM, &stop_action, NULL);
+	sigaction(SIGINT, &stop_action, NULL);
+	signal(SIGCHLD, SIG_DFL);
+	setup_stats_signal();
+	setup_reopen_signal();
+
+	setup_metrics(workers);
+	for(long int i = 0; i < workers; i++) {
+		start_worker(i);
+	}
 
-			if(conn->beginning_of_line && max_left >= 2 && memcmp(start, "..", 2) == 0) {
-				// Remove the double period in the beginning of line
-				start++;
-				max_left--;
-				skipped += 1;
-			} else if(conn->beginning_of_line && max_left >= 3 && memcmp(start, ".\r\n", 3) == 0) {
-				// Close connection
-				remove_connection(index);
-				return;
+	while(!stop_requested) {
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if(pid < 0) {
+			if(errno == EINTR) {
+				if(stats_requested) {
+					// Statistics live in the workers, pass the request on
+					stats_requested = 0;
+					for(long int i = 0; i < workers; i++) {
+						kill(worker_table[i].pid, SIGUSR2);
+					}
+				}
+				if(reopen_requested) {
+					// So does the writing of the access log
+					reopen_requested = 0;
+					for(long int i = 0; i < workers; i++) {
+						kill(worker_table[i].pid, SIGUSR1);
+					}
+				}
+				continue;
 			}
+			perror("waitpid");
+			exit(1);
+		}
 
-			char *end = memchr(start, '\n', max_left);
+		for(long int i = 0; i < workers; i++) {
+			if(worker_table[i].pid != pid) {
+				continue;
+			}
 
-			size_t left;
-			if(end == NULL) {
-				left = max_left;
-				conn->beginning_of_line = false;
+			if(WIFSIGNALED(status)) {
+				log_error("%s: worker %li killed by signal %i, restarting\n", program_name, (long int)pid, WTERMSIG(status));
 			} else {
-				// Include the \n in the sent text as well
-				left = end - start + 1;
-				conn->beginning_of_line = true;
+				log_error("%s: worker %li exited with status %i, restarting\n", program_name, (long int)pid, WEXITSTATUS(status));
 			}
 
-			amount = send(conn->sock, start, left, 0);
-		} else {
-			log_error("%s: Illegal value of conn->copymode: %i", program_name, conn->copymode);
-			exit(1);
-		}
+			// Don't spin if the worker keeps dying right away
+			if(time(NULL) - worker_table[i].started < 1) {
+				sleep(1);
+			}
 
-		if(amount == -1) {
-			remove_connection(index);
-			return;
+			if(!stop_requested) {
+				start_worker(i);
+			}
+			break;
 		}
+	}
 
-		conn->written += amount + skipped;
-
-		if(conn->written >= conn->read) {
-			// Switch socket and change to read mode
-			switch_sockets(conn);
-			socket_change(conn->sock_other, conn->sock, POLLIN);
-
-			conn->state = READ;
-			// Return because socket was changed
-			return;
-		}
+	// Take the workers down with us
+	for(long int i = 0; i < workers; i++) {
+		kill(worker_table[i].pid, SIGTERM);
 	}
-}
+	while(waitpid(-1, NULL, 0) > 0 || errno == EINTR);
 
-void drop_privileges(void) {
-	uid_t uid = getuid();
-	gid_t gid = getgid();
+	exit(0);
+}
 
-	if(setresgid(gid, gid, gid) != 0) {
-		perror("setresgid");
+void add_backend(const char *host, long int port) {
+	if(number_backends == BACKENDS_MAX) {
+		log_error("%s: No more than %i backends\n", program_name, BACKENDS_MAX);
 		exit(1);
 	}
-	if(setresuid(uid, uid, uid) != 0) {
-		perror("setresuid");
+	struct backend *backend = &backends[number_backends++];
+	backend->host = host;
+	backend->port = port;
+	backend->healthy = true;
+	backend->probe.type = PROBE_HANDLE;
+	backend->probe.fd = -1;
+
+	// getaddrinfo wants port as a string, so stringify it
+	if(!stringify_port(port, backend->port_string, sizeof(backend->port_string))) {
+		log_error("%s: Could not convert %li to string\n", program_name, port);
 		exit(1);
 	}
+
+	// Name for the logs and metrics, which also places it for the selector hash
+	snprintf(backend->name, sizeof(backend->name), strchr(host, ':') != NULL ? "[%s]:%li" : "%s:%li", host, port);
+	backend->hash = cache_hash(0, backend->name, strlen(backend->name));
 }
 
+void read_backends(const char *path) {
+	// A backend per line, as host and optionally port, with blank lines and anything after a # ignored
+	FILE *file = fopen(path, "r");
+	if(file == NULL) {
+		log_error("%s: Could not open %s: %s\n", program_name, path, strerror(errno));
+		exit(1);
+	}
+
+	char *line = NULL;
+	size_t line_allocated = 0;
+	for(size_t number = 1; getline(&line, &line_allocated, file) != -1; number++) {
+		line[strcspn(line, "#")] = '\0';
+		char *host = strtok(line, " \t\r\n");
+		if(host == NULL) {
+			continue;
+		}
+		char *port_string = strtok(NULL, " \t\r\n");
+		long int port = port_string != NULL ? parse_port(port_string) : 70;
+		if(port < 0 || strtok(NULL, " \t\r\n") != NULL) {
+			log_error("%s: %s:%zu: Expected host and optionally port\n", program_name, path, number);
+			exit(1);
+		}
+
+		host = strdup(host);
+		if(host == NULL) {
+			perror("strdup");
+			exit(1);
+		}
+		add_backend(host, port);
+	}
+
+	free(line);
+	fclose(file);
+}
 
 int main(int argc, char **argv) {
 	// Store proram name for later use
@@ -825,17 +5952,53 @@ int main(int argc, char **argv) {
 		free(argv0);
 	}
 
+	// No itemtype has its own cache TTL until told otherwise
+	for(size_t i = 0; i < sizeof(cache_ttls) / sizeof(*cache_ttls); i++) {
+		cache_ttls[i] = -1;
+	}
+
 	// Do option handling
 	struct option long_options[] = {
 		{"help", no_argument, 0, 0},
 		{"port", required_argument, 0, 'p'},
 		{"daemon", no_argument, 0, 'd'},
+		{"engine", required_argument, 0, 0},
+		{"workers", required_argument, 0, 'w'},
+		{"pool-size", required_argument, 0, 0},
+		{"max-connections", required_argument, 0, 0},
+		{"backlog", required_argument, 0, 0},
+		{"metrics", required_argument, 0, 0},
+		{"access-log", required_argument, 0, 0},
+		{"header-timeout", required_argument, 0, 0},
+		{"connect-timeout", required_argument, 0, 0},
+		{"remote-timeout", required_argument, 0, 0},
+		{"client-timeout", required_argument, 0, 0},
+		{"resolve-ttl", required_argument, 0, 0},
+		{"backends", required_argument, 0, 0},
+		{"balance", required_argument, 0, 0},
+		{"health-interval", required_argument, 0, 0},
+		{"buffer-size", required_argument, 0, 0},
+		{"high-watermark", required_argument, 0, 0},
+		{"low-watermark", required_argument, 0, 0},
+		{"no-splice", no_argument, 0, 0},
+		{"no-coalesce", no_argument, 0, 0},
+		{"cache-size", required_argument, 0, 0},
+		{"cache-max-object", required_argument, 0, 0},
+		{"compression-level", required_argument, 0, 0},
+		{"compression-min-size", required_argument, 0, 0},
+		{"cache-ttl", required_argument, 0, 0},
+		{"disk-cache", required_argument, 0, 0},
+		{"disk-cache-size", required_argument, 0, 0},
+		{"disk-cache-max-object", required_argument, 0, 0},
+		{"prefetch", required_argument, 0, 0},
+		{"prefetch-concurrency", required_argument, 0, 0},
+		{"prefetch-budget", required_argument, 0, 0},
 		{0, 0, 0, 0}
 	};
 
 	for(;;) {
 		int long_option_index;
-		int opt = getopt_long(argc, argv, "dp:", long_options, &long_option_index);
+		int opt = getopt_long(argc, argv, "dp:w:", long_options, &long_option_index);
 		// Used for daemonization
 		pid_t child;
 		int fd;
@@ -849,6 +6012,178 @@ int main(int argc, char **argv) {
 				if(strcmp(long_options[long_option_index].name, "help") == 0) {
 					help(stdout);
 					exit(0);
+				} else if(strcmp(long_options[long_option_index].name, "engine") == 0) {
+					if(strcmp(optarg, "epoll") == 0) {
+						engine = EPOLL_ENGINE;
+					} else if(strcmp(optarg, "poll") == 0) {
+						engine = POLL_ENGINE;
+					} else {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "pool-size") == 0) {
+					pool_size = parse_number(optarg, 0, 1000000);
+					if(pool_size < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "max-connections") == 0) {
+					max_connections = parse_number(optarg, 0, LONG_MAX);
+					if(max_connections < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "backlog") == 0) {
+					listen_backlog = parse_number(optarg, 1, INT_MAX);
+					if(listen_backlog < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "metrics") == 0) {
+					metrics_path = optarg;
+				} else if(strcmp(long_options[long_option_index].name, "access-log") == 0) {
+					access_log_path = optarg;
+				} else if(strcmp(long_options[long_option_index].name, "header-timeout") == 0) {
+					header_timeout = parse_number(optarg, 1, 86400);
+					if(header_timeout < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "remote-timeout") == 0) {
+					remote_timeout = parse_number(optarg, 1, 86400);
+					if(remote_timeout < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "client-timeout") == 0) {
+					client_timeout = parse_number(optarg, 1, 86400);
+					if(client_timeout < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "connect-timeout") == 0) {
+					connect_timeout = parse_number(optarg, 1, 3600000);
+					if(connect_timeout < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "resolve-ttl") == 0) {
+					resolve_ttl = parse_number(optarg, 1, 86400);
+					if(resolve_ttl < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "backends") == 0) {
+					read_backends(optarg);
+				} else if(strcmp(long_options[long_option_index].name, "balance") == 0) {
+					if(strcmp(optarg, "least-connections") == 0) {
+						balance = LEAST_CONNECTIONS;
+					} else if(strcmp(optarg, "selector-hash") == 0) {
+						balance = SELECTOR_HASH;
+					} else {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "health-interval") == 0) {
+					health_interval = parse_number(optarg, 0, 86400);
+					if(health_interval < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "buffer-size") == 0) {
+					ring_size = parse_number(optarg, 1024, 1 << 30);
+					if(ring_size < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "high-watermark") == 0) {
+					high_watermark = parse_number(optarg, 1, 1 << 30);
+					if(high_watermark < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "low-watermark") == 0) {
+					low_watermark = parse_number(optarg, 0, 1 << 30);
+					if(low_watermark < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "no-splice") == 0) {
+					use_splice = false;
+				} else if(strcmp(long_options[long_option_index].name, "no-coalesce") == 0) {
+					use_coalescing = false;
+				} else if(strcmp(long_options[long_option_index].name, "cache-size") == 0) {
+					cache_size = parse_number(optarg, 0, LONG_MAX);
+					if(cache_size < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "compression-level") == 0) {
+					compression_level = parse_number(optarg, 0, 9);
+					if(compression_level < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "compression-min-size") == 0) {
+					compression_min_size = parse_number(optarg, 0, LONG_MAX);
+					if(compression_min_size < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "cache-max-object") == 0) {
+					cache_max_object = parse_number(optarg, 0, LONG_MAX);
+					if(cache_max_object < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "cache-ttl") == 0) {
+					// Either itemtype:seconds for a single itemtype, or just seconds for the default
+					if(optarg[0] != '\0' && optarg[1] == ':') {
+						long int ttl = parse_number(optarg + 2, 0, 31536000);
+						if(ttl < 0) {
+							usage(stderr);
+							exit(1);
+						}
+						cache_ttls[(unsigned char)optarg[0]] = ttl;
+					} else {
+						cache_default_ttl = parse_number(optarg, 0, 31536000);
+						if(cache_default_ttl < 0) {
+							usage(stderr);
+							exit(1);
+						}
+					}
+				} else if(strcmp(long_options[long_option_index].name, "disk-cache") == 0) {
+					disk_cache_root = optarg;
+				} else if(strcmp(long_options[long_option_index].name, "disk-cache-size") == 0) {
+					disk_cache_size = parse_number(optarg, 0, LONG_MAX);
+					if(disk_cache_size < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "disk-cache-max-object") == 0) {
+					disk_cache_max_object = parse_number(optarg, 0, LONG_MAX);
+					if(disk_cache_max_object < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "prefetch") == 0) {
+					prefetch_links = parse_number(optarg, 0, PREFETCH_QUEUE);
+					if(prefetch_links < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "prefetch-concurrency") == 0) {
+					prefetch_concurrency = parse_number(optarg, 1, 1024);
+					if(prefetch_concurrency < 0) {
+						usage(stderr);
+						exit(1);
+					}
+				} else if(strcmp(long_options[long_option_index].name, "prefetch-budget") == 0) {
+					prefetch_budget = parse_number(optarg, 1, 1L << 40);
+					if(prefetch_budget < 0) {
+						usage(stderr);
+						exit(1);
+					}
 				}
 				break;;
 
@@ -891,82 +6226,88 @@ int main(int argc, char **argv) {
 				}
 				break;;
 
+			case 'w':
+				workers = parse_number(optarg, 0, 1024);
+				if(workers < 0) {
+					usage(stderr);
+					exit(1);
+				}
+				break;;
+
 			default:
 				usage(stderr);
 				exit(1);
 		}
 	}
 
-	if(optind == argc - 2) {
-		// 2 arguments left -> remote and remote_port
-		remote = argv[optind];
-		remote_port = parse_port(argv[optind + 1]);
-		if(remote_port < 0) {
-			usage(stderr);
-			exit(1);
+	// The arguments left are backends, each a remote optionally followed by its port
+	// Anything numeric after a remote is meant as its port, rather than an address or dotted name, so a bad port is an error rather than another backend
+	for(int i = optind; i < argc; i++) {
+		const char *host = argv[i];
+		long int port = 70;
+		if(i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]) && strpbrk(argv[i + 1], ".:") == NULL) {
+			port = parse_port(argv[++i]);
+			if(port < 0) {
+				usage(stderr);
+				exit(1);
+			}
 		}
-	} else if(optind == argc - 1) {
-		// 1 argument left -> only remote
-		remote = argv[optind];
-	} else {
+		add_backend(host, port);
+	}
+	if(number_backends == 0) {
 		usage(stderr);
 		exit(1);
 	}
 
-	// getaddrinfo wants port as a string, so stringify it
-	if(!stringify_port(remote_port, remote_port_string, sizeof(remote_port_string))) {
-		log_error("%s: Could not convert %li to string\n", program_name, remote_port);
+	// Fill in the watermarks not given and make sure they make sense
+	if(high_watermark < 0) {
+		high_watermark = ring_size;
+	}
+	if(low_watermark < 0) {
+		low_watermark = high_watermark / 2;
+	}
+	if(high_watermark > ring_size || low_watermark > high_watermark) {
+		log_error("%s: Watermarks must satisfy low <= high <= buffer size\n", program_name);
 		exit(1);
 	}
 
-	// Populate the table of sockets with all possible sockets to listen on
-	setup_listen(server_port);
-
-	// Drop privileges or die trying
-	drop_privileges();
-
-	// Poll
-	while(1) {
-		int amount_ready = poll(sockets, number_sockets, -1);
-		if(amount_ready < 0) {
-			perror("poll");
-			exit(1);
-		}
-
-		for(size_t i = 0; i < number_sockets && amount_ready > 0; i++) {
-			// While the order of sockets in the table gets rearranged if one is removed, the rearrangement only affects sockets created after the removed one
-			// Thus, as long as an interface is not removed from the table, all sockets < number_interfaces are interfaces and other data sockets
-			if(i < number_interfaces) {
-				// Interface socket
-				if(sockets[i].revents & POLLIN) {
-					struct sockaddr_storage client_addr;
-					socklen_t addr_size = sizeof(client_addr);
-
-					int sock = accept(sockets[i].fd, (struct sockaddr *)&client_addr, &addr_size);
-
-					add_connection(sock);
+	// Prefetching fills the cache, so there has to be one
+	if(prefetch_links > 0 && cache_size == 0 && disk_cache_root == NULL) {
+		log_error("%s: --prefetch needs --cache-size or --disk-cache\n", program_name);
+		exit(1);
+	}
 
-					amount_ready--;
-				}
-			} else {
-				if(sockets[i].revents & (POLLHUP | POLLIN | POLLOUT)) {
-					// Data socket
-					size_t connection_index = get_connection_index(sockets[i].fd);
+	// Writing to a client that went away should fail with EPIPE rather than kill us, and splice() has no MSG_NOSIGNAL
+	signal(SIGPIPE, SIG_IGN);
 
-					if(connection_index == number_connections) {
-						log_error("%s: socket does not correspond to any connection\n", program_name);
-						exit(1);
-					}
+	setup_find_newline_period();
 
-					if(sockets[i].revents & POLLHUP) {
-						remove_connection(connection_index);
-					} else {
-						handle_connection(connection_index);
-					}
+	// Opened before dropping privileges, like the listening sockets, and shared by all workers
+	if(access_log_path != NULL) {
+		open_access_log();
+	}
 
-					amount_ready--;
-				}
-			}
+	if(workers == 0) {
+		// Populate the table of listening sockets with all possible sockets to listen on
+		setup_listen(server_port);
+
+		// Drop privileges or die trying
+		drop_privileges();
+
+		setup_stats_signal();
+		setup_reopen_signal();
+		setup_metrics(1);
+		use_metrics(0);
+		setup_engine();
+		setup_connection_pool();
+		watch_listeners(0, number_listeners);
+		setup_resolver();
+		setup_disk_cache();
+		if(access_log_fd != -1) {
+			start_access_log();
 		}
+		event_loop();
+	} else {
+		supervise();
 	}
 }